@@ -626,7 +626,9 @@ STBSP__PUBLICDEF int STB_SPRINTF_DECORATE(vsprintfcb)(STBSP_SPRINTFCB *callback,
       case 'E':              // float
       case 'e':              // float
       case 'f':              // float
+#ifdef __SSE__ // without SSE (-mgeneral-regs-only) no double can be passed
          va_arg(va, double); // eat it
+#endif
          s = (char *)"No float";
          l = 8;
          lead[0] = 0;
@@ -16,6 +16,13 @@ export namespace arch {
         return (ebx >> 24) & 0xFF;  // initial APIC ID (processor/core ID)
     }
 
+    inline void
+    cpuid( u32 leaf, u32 subleaf, u32 &eax, u32 &ebx, u32 &ecx, u32 &edx ) {
+        __asm__ volatile( "cpuid"
+                          : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                          : "a"(leaf), "c"(subleaf) );
+    }
+
     void
     atomic_exchange( u64 *where, u64 value ) {
         asm volatile (
@@ -26,6 +33,20 @@ export namespace arch {
             );
     }
 
+    inline u64
+    rdtsc() {
+        u32 lo, hi;
+        __asm__ volatile( "rdtsc" : "=a"(lo), "=d"(hi) );
+        return ((u64)hi << 32) | lo;
+    }
+
+    // Spin-wait hint: saves power and avoids the memory-order flush when
+    // the awaited cache line finally changes.
+    inline void
+    cpu_relax() {
+        __asm__ volatile( "pause" : : : "memory" );
+    }
+
     void 
     halt_cpu() {
         while( true ) {
@@ -47,6 +68,35 @@ export namespace arch {
         asm volatile ("wrmsr" :: "c"(msr), "a"(low), "d"(high));
     }
 
+    inline u64
+    read_cr0() {
+        u64 val;
+        __asm__ volatile( "mov %%cr0, %0" : "=r"(val) );
+        return val;
+    }
+
+    inline void
+    write_cr0( u64 val ) {
+        __asm__ volatile( "mov %0, %%cr0" : : "r"(val) : "memory" );
+    }
+
+    inline u64
+    read_cr4() {
+        u64 val;
+        __asm__ volatile( "mov %%cr4, %0" : "=r"(val) );
+        return val;
+    }
+
+    inline void
+    write_cr4( u64 val ) {
+        __asm__ volatile( "mov %0, %%cr4" : : "r"(val) : "memory" );
+    }
+
+    inline void
+    xsetbv( u32 xcr, u64 value ) {
+        __asm__ volatile( "xsetbv" : : "c"(xcr), "a"((u32)value), "d"((u32)(value >> 32)) );
+    }
+
     void
     enable_interrupts() {
         __asm__ volatile("sti");
@@ -56,4 +106,34 @@ export namespace arch {
     disable_interrupts() {
         __asm__ volatile("cli");
     }
+
+    // Disable interrupts and return the previous RFLAGS for irq_restore()
+    inline u64
+    irq_save() {
+        u64 flags;
+        __asm__ volatile( "pushfq; pop %0; cli" : "=r"(flags) : : "memory" );
+        return flags;
+    }
+
+    inline void
+    irq_restore( u64 flags ) {
+        if( flags & (1 << 9) )  // RFLAGS.IF
+            __asm__ volatile( "sti" : : : "memory" );
+    }
+
+    constexpr auto IA32_TSC_AUX = 0xC0000103;
+
+    // Store the index of this CPU in TSC_AUX so this_cpu() can read it back
+    // with rdtscp instead of a (trapping) cpuid.
+    void
+    set_this_cpu( u32 id ) {
+        write_msr( IA32_TSC_AUX, id );
+    }
+
+    inline u32
+    this_cpu() {
+        u32 lo, hi, aux;
+        __asm__ volatile( "rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux) );
+        return aux;
+    }
 }
\ No newline at end of file
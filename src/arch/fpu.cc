@@ -0,0 +1,150 @@
+export module arch.fpu;
+
+import types;
+import arch.cpu;
+import lib.print;
+import lib.string;
+import mm.slab;
+
+// FPU/SSE/AVX state handling. The kernel itself is built without vector
+// registers; only task-context functions that opt in (target attribute,
+// see the Makefile) use them, and a task's first use traps with #NM to get
+// its own extended state. The scheduler decides when to save and restore,
+// this module only knows how.
+constexpr auto CR0_MP           = 1UL << 1;
+constexpr auto CR0_EM           = 1UL << 2;
+constexpr auto CR0_TS           = 1UL << 3;
+constexpr auto CR0_NE           = 1UL << 5;
+constexpr auto CR4_OSFXSR       = 1UL << 9;
+constexpr auto CR4_OSXMMEXCPT   = 1UL << 10;
+constexpr auto CR4_OSXSAVE      = 1UL << 18;
+
+constexpr auto CPUID1_ECX_XSAVE = 1U << 26;
+constexpr auto XSAVE_XSAVEOPT   = 1U << 0;     // CPUID 0xD.1:EAX
+
+// x87, SSE, AVX and the three AVX-512 components
+constexpr auto XFEATURE_MASK    = 0xE7UL;
+
+constexpr auto FXSAVE_SIZE      = 512U;
+constexpr auto FPU_STATE_ALIGN  = 64UL;
+
+constexpr auto FCW_DEFAULT      = 0x037F;      // all x87 exceptions masked
+constexpr auto MXCSR_DEFAULT    = 0x1F80;      // all SSE exceptions masked
+
+enum fpu_save_mode {
+    FPU_FXSAVE,
+    FPU_XSAVE,
+    FPU_XSAVEOPT,
+};
+
+static fpu_save_mode      save_mode;
+static u32                state_size = FXSAVE_SIZE;
+static u64                xfeatures;
+static mm::kmem_cache_t  *fpu_cache;
+
+export namespace arch {
+    /*
+     * Enable SSE and, where supported, XSAVE on this CPU and leave the FPU
+     * disabled (CR0.TS set) so the first use traps. Run on every CPU; the
+     * boot CPU also sizes the save area from CPUID leaf 0xD.
+     */
+    void
+    init_fpu() {
+        u32 eax, ebx, ecx, edx;
+
+        cpuid( 1, 0, eax, ebx, ecx, edx );
+        bool has_xsave = ecx & CPUID1_ECX_XSAVE;
+
+        auto cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+        if( has_xsave )
+            cr4 |= CR4_OSXSAVE;
+        write_cr4( cr4 );
+
+        write_cr0( (read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE );
+        __asm__ volatile( "clts; fninit" );
+
+        if( has_xsave ) {
+            cpuid( 0xD, 0, eax, ebx, ecx, edx );
+            u64 features = (((u64)edx << 32) | eax) & XFEATURE_MASK;
+            xsetbv( 0, features );
+
+            if( this_cpu() == 0 ) {
+                // EBX is the size needed for the features enabled in XCR0
+                cpuid( 0xD, 0, eax, ebx, ecx, edx );
+                state_size = ebx;
+                xfeatures  = features;
+
+                cpuid( 0xD, 1, eax, ebx, ecx, edx );
+                save_mode = eax & XSAVE_XSAVEOPT ? FPU_XSAVEOPT : FPU_XSAVE;
+            }
+        }
+
+        if( this_cpu() == 0 ) {
+            // Once, here: #NM traps can allocate on several CPUs at a time
+            fpu_cache = mm::kmem_cache_create( "fpu_state", state_size, FPU_STATE_ALIGN );
+
+            printk( "[FPU] %s, features 0x%lx, %d byte save area\n",
+                    save_mode == FPU_XSAVEOPT ? "xsaveopt" : save_mode == FPU_XSAVE ? "xsave" : "fxsave",
+                    xfeatures, state_size );
+        }
+
+        write_cr0( read_cr0() | CR0_TS );
+    }
+
+    // Let the current task use the FPU without trapping
+    inline void
+    fpu_enable() {
+        __asm__ volatile( "clts" );
+    }
+
+    // Trap with #NM on the next FPU/SSE/AVX instruction
+    inline void
+    fpu_disable() {
+        write_cr0( read_cr0() | CR0_TS );
+    }
+
+    void
+    fpu_save( void *area ) {
+        switch( save_mode ) {
+        case FPU_XSAVEOPT:
+            // Skips components that are unmodified since the last xrstor
+            __asm__ volatile( "xsaveopt64 (%0)" : : "r"(area), "a"(~0U), "d"(~0U) : "memory" );
+            break;
+        case FPU_XSAVE:
+            __asm__ volatile( "xsave64 (%0)" : : "r"(area), "a"(~0U), "d"(~0U) : "memory" );
+            break;
+        default:
+            __asm__ volatile( "fxsave64 (%0)" : : "r"(area) : "memory" );
+        }
+    }
+
+    void
+    fpu_restore( void *area ) {
+        if( save_mode == FPU_FXSAVE )
+            __asm__ volatile( "fxrstor64 (%0)" : : "r"(area) : "memory" );
+        else
+            __asm__ volatile( "xrstor64 (%0)" : : "r"(area), "a"(~0U), "d"(~0U) : "memory" );
+    }
+
+    /*
+     * A save area in the initial state: an all-zero XSAVE header marks
+     * every component as in its init configuration, only the control
+     * words need their power-up values.
+     */
+    void *
+    fpu_state_alloc() {
+        auto area = (u8 *)mm::kmem_cache_alloc( fpu_cache );
+        if( !area )
+            panic( "fpu_state_alloc: out of memory" );
+
+        memset( area, 0, state_size );
+        *(u16 *)(area + 0)  = FCW_DEFAULT;
+        *(u32 *)(area + 24) = MXCSR_DEFAULT;
+        return area;
+    }
+
+    void
+    fpu_state_free( void *area ) {
+        mm::kmem_cache_free( fpu_cache, area );
+    }
+}
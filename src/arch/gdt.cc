@@ -7,7 +7,8 @@ export namespace arch {
     constexpr auto KERNEL_DS = 0x10;
     constexpr auto USER_CS   = 0x18;
     constexpr auto USER_DS   = 0x20;
-    constexpr auto TSS_SEL   = 0x28;
+    constexpr auto TSS_SEL   = 0x28;   // CPU 0, each further CPU adds 0x10
+    constexpr auto NR_GDT    = 5 + 2 * MAX_CPU;
 
     struct [[gnu::packed]] gdt_entry {
         u16 limit_low;
@@ -54,7 +55,7 @@ export namespace arch {
         } __attribute__((packed));
 
 
-    alignas(16) gdt_entry gdt[6];
+    alignas(16) gdt_entry gdt[NR_GDT];
     alignas(16) tss tss[MAX_CPU];
     alignas(16) gdt_pointer gdtp;
 
@@ -95,18 +96,18 @@ export namespace arch {
         tss_desc->reserved = 0;
     }
 
-    void 
-    init_gdt() {
-        set_gdt_entry(0, 0, 0, 0, 0);                  // Null
-        set_gdt_entry(1, 0, 0xFFFFF, 0x9A, 0xA0);      // Kernel code
-        set_gdt_entry(2, 0, 0xFFFFF, 0x92, 0xA0);      // Kernel data
-        set_gdt_entry(3, 0, 0xFFFFF, 0xFA, 0xA0);      // User code (DPL=3)
-        set_gdt_entry(4, 0, 0xFFFFF, 0xF2, 0xA0);      // User data (DPL=3)
-        set_tss_entry(5, (u64)tss, sizeof(tss));
-
-        gdtp.limit = sizeof(gdt) + sizeof(tss_descriptor) - 1;
-        gdtp.base  = reinterpret_cast<u64>(&gdt);
+    // Every CPU has its own TSS and descriptor; they share the rest
+    inline u16
+    tss_selector( u32 cpu ) {
+        return TSS_SEL + cpu * sizeof(tss_descriptor);
+    }
 
+    /*
+     * Load the shared GDT on this CPU, reload the segment registers and
+     * point the task register at the CPU's own TSS.
+     */
+    void
+    load_gdt( u32 cpu ) {
         asm( "lgdt %0"      : : "m"(gdtp) );
         asm( "mov %0, %%ds" : : "r"(0x10) );
         asm( "mov %0, %%es" : : "r"(0x10) );
@@ -117,7 +118,25 @@ export namespace arch {
         asm( "lea 1f(%%rip), %%rax    \n"
              "push %%rax              \n"
              "lretq                   \n"  
-             "ltr %0                  \n"
-             "1:                      \n" :: "r"(TSS_SEL): "rax" );  
+             "1:                      \n" ::: "rax" );  
+        asm( "ltr %0" : : "r"(tss_selector( cpu )) );
+    }
+
+    void 
+    init_gdt() {
+        set_gdt_entry(0, 0, 0, 0, 0);                  // Null
+        set_gdt_entry(1, 0, 0xFFFFF, 0x9A, 0xA0);      // Kernel code
+        set_gdt_entry(2, 0, 0xFFFFF, 0x92, 0xA0);      // Kernel data
+        set_gdt_entry(3, 0, 0xFFFFF, 0xFA, 0xA0);      // User code (DPL=3)
+        set_gdt_entry(4, 0, 0xFFFFF, 0xF2, 0xA0);      // User data (DPL=3)
+        for( auto cpu = 0; cpu < MAX_CPU; cpu++ ) {
+            tss[cpu].iomap_base = sizeof(tss[cpu]);     // no I/O bitmap
+            set_tss_entry( 5 + 2 * cpu, (u64)&tss[cpu], sizeof(tss[cpu]) - 1 );
+        }
+
+        gdtp.limit = sizeof(gdt) - 1;
+        gdtp.base  = reinterpret_cast<u64>(&gdt);
+
+        load_gdt( 0 );
     }
 }
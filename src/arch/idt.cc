@@ -5,9 +5,12 @@ import lib.print;
 import lib.string;
 import arch.cpu;
 import arch.io;
+import lib.trace;
 
 #include "idt_handlers.h"
 
+constexpr auto PIC_VECTOR_BASE = 0x20;  // see disable_pic() in lapic.cc
+
 typedef struct [[gnu::packed]] {
     u16 offset_lo;    ///< base address bits 0..15
     u16 selector;     ///< code segment selector, typically 0x08
@@ -90,11 +93,9 @@ export namespace arch {
     irq_handler_t *callbacks[ 256 ] = { 0 };
 
 
-    void 
-    init_idt() {
-        for( size_t i = 0; i < 256; i++ )
-            register_interrupt_handler(i, reinterpret_cast<void*>(handlers[i]), 0, 0x8e);
-
+    // All CPUs share one IDT, each one has to load it
+    void
+    load_idt() {
         idt_ptr idt_ptr = {
             sizeof(idt_table) - 1,
             (u64)idt_table
@@ -105,15 +106,33 @@ export namespace arch {
             :
             : "m" (idt_ptr)
         );
+    }
+
+    void 
+    init_idt() {
+        for( size_t i = 0; i < 256; i++ )
+            register_interrupt_handler(i, reinterpret_cast<void*>(handlers[i]), 0, 0x8e);
+
+        load_idt();
 
         memset( callbacks, 0, sizeof(callbacks) );
     }
 
+    // Unmask line `irq` of the 8259 pair, remapped to PIC_VECTOR_BASE
     void
-    lapic_unmask_irq( ulong irq ) {
-        u8 mask = arch::inb( 0x21 );
-        mask &= ~(1 || (irq - 0x20) );
-        arch::outb( 0x21, mask );
+    pic_unmask_irq( u32 irq ) {
+        if( irq >= 8 ) {
+            arch::outb( 0xA1, arch::inb( 0xA1 ) & ~(1 << (irq - 8)) );
+            irq = 2;    // cascade
+        }
+        arch::outb( 0x21, arch::inb( 0x21 ) & ~(1 << irq) );
+    }
+
+    void
+    pic_eoi( u32 irq ) {
+        if( irq >= 8 )
+            arch::outb( 0xA0, 0x20 );
+        arch::outb( 0x20, 0x20 );
     }
 
     void
@@ -123,23 +142,31 @@ export namespace arch {
 
         callbacks[no] = handler;
 
-        printk( "[IRQ] Unmasking irq %i\n", no - 32 );
-        lapic_unmask_irq( no - 32 );
+        // 0x21-0x2F are 8259 lines; 0x20 is the LAPIC timer, the PIT's
+        // line 0 stays masked
+        if( no > PIC_VECTOR_BASE && no < PIC_VECTOR_BASE + 16 ) {
+            printk( "[IRQ] Unmasking irq %i\n", no - PIC_VECTOR_BASE );
+            pic_unmask_irq( no - PIC_VECTOR_BASE );
+        }
     }
 }
 
 extern "C" void
 handle_interrupt( arch::interrupt_context *ctx ) {
-    u64 cr2;
-
-    asm( "mov %%cr2, %0" : "=r"(cr2) );
+    trace::emit( trace::EV_IRQ_ENTRY, ctx->int_no, ctx->rip );
 
     if( arch::callbacks[ctx->int_no] ) {
         arch::callbacks[ctx->int_no]( ctx );
+        trace::emit( trace::EV_IRQ_EXIT, ctx->int_no );
     } else {
+        // Only a page fault leaves anything meaningful in CR2
+        u64 cr2 = 0;
+        if( ctx->int_no == 14 )
+            asm volatile( "mov %%cr2, %0" : "=r"(cr2) );
+
         printk( "Interrupt %i: %s | CR2: 0x%x\n", ctx->int_no, ctx->int_no < 32 ? error_msgs[ctx->int_no] : "IRQ", cr2 );
         debug::print_stacktrace(ctx->rip, ctx->regs.rbp);
 
-        arch::halt_cpu(); // Halt the CPU after handling the interrupt
+        panic( "unhandled interrupt" );   // also flushes the log rings
     }
 }
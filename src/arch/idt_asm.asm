@@ -61,9 +61,10 @@ ISR_FILL
 
 extern handle_interrupt
 
+; Interrupt gates clear IF on entry and iretq restores it, so the stub
+; leaves it alone
 service_interrupt:
-	cli
-    push rax
+	push rax
 	push rbx
 	push rcx
 	push rdx
@@ -98,99 +99,92 @@ service_interrupt:
 	pop rbx
 	pop rax
 
-	sti
-
 	add rsp, 16
 	iretq
 
+; Fast entries for the high-rate LAPIC vectors, installed by init_lapic()
+; over the generic stubs. They go straight to their handler with the
+; interrupted rip as argument and save only the registers a C call may
+; clobber: the handler keeps the callee-saved ones, and so does switch_to
+; if the handler ends up switching tasks. Nine pushes on top of the
+; 5-word CPU frame leave the stack 16-byte aligned for the call.
+%macro ISR_FAST 2
+global %1
+%1:
+	push rax
+	push rcx
+	push rdx
+	push rsi
+	push rdi
+	push r8
+	push r9
+	push r10
+	push r11
+
+	mov rdi, [rsp + 9 * 8]
+	call %2
+
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rdi
+	pop rsi
+	pop rdx
+	pop rcx
+	pop rax
+	iretq
+%endmacro
+
+extern lapic_timer_interrupt
+extern sched_resched_interrupt
+
+ISR_FAST isr_lapic_timer, lapic_timer_interrupt
+ISR_FAST isr_resched, sched_resched_interrupt
+
+; Spurious LAPIC interrupts need no EOI and no work
+global isr_spurious
+isr_spurious:
+	iretq
+
 section .text
 
-global switch_context
-
-; void switch_context(task_context_t *old_ctx, task_context_t *new_ctx)
-; rdi = old_ctx, rsi = new_ctx
-switch_context:
-    ; Save current task's context to old_ctx
-    mov [rdi + 0],  rax    ; rax
-    mov [rdi + 8],  rbx    ; rbx
-    mov [rdi + 16], rcx    ; rcx
-    mov [rdi + 24], rdx    ; rdx
-    mov [rdi + 32], rsi    ; rsi (overwritten by new_ctx, but we save original)
-    mov rax, rdi           ; save old rdi in rax temporarily
-    mov [rdi + 40], rax    ; rdi (original value before function call)
-    mov [rdi + 48], rbp    ; rbp
-    mov [rdi + 56], rsp    ; rsp
-    mov [rdi + 64], r8     ; r8
-    mov [rdi + 72], r9     ; r9
-    mov [rdi + 80], r10    ; r10
-    mov [rdi + 88], r11    ; r11
-    mov [rdi + 96], r12    ; r12
-    mov [rdi + 104], r13   ; r13
-    mov [rdi + 112], r14   ; r14
-    mov [rdi + 120], r15   ; r15
-    
-    ; Save rip (return address from stack)
-    mov rax, [rsp]
-    mov [rdi + 128], rax   ; rip
-    
-    ; Save rflags
-    pushfq
-    pop rax
-    mov [rdi + 136], rax   ; rflags
-    
-    ; Save segment registers
-    mov ax, cs
-    mov [rdi + 144], ax    ; cs
-    mov ax, ss
-    mov [rdi + 146], ax    ; ss
-    mov ax, ds
-    mov [rdi + 148], ax    ; ds
-    mov ax, es
-    mov [rdi + 150], ax    ; es
-    mov ax, fs
-    mov [rdi + 152], ax    ; fs
-    mov ax, gs
-    mov [rdi + 154], ax    ; gs
-
-    ; Load new task's context from new_ctx (rsi)
-    mov rax, [rsi + 0]     ; rax
-    mov rbx, [rsi + 8]     ; rbx
-    mov rcx, [rsi + 16]    ; rcx
-    mov rdx, [rsi + 24]    ; rdx
-    ; Skip rsi for now, we need it to access new_ctx
-    mov rdi, [rsi + 40]    ; rdi
-    mov rbp, [rsi + 48]    ; rbp
-    mov rsp, [rsi + 56]    ; rsp
-    mov r8,  [rsi + 64]    ; r8
-    mov r9,  [rsi + 72]    ; r9
-    mov r10, [rsi + 80]    ; r10
-    mov r11, [rsi + 88]    ; r11
-    mov r12, [rsi + 96]    ; r12
-    mov r13, [rsi + 104]   ; r13
-    mov r14, [rsi + 112]   ; r14
-    mov r15, [rsi + 120]   ; r15
-    
-    ; Load rflags
-    mov r8, [rsi + 136]    ; rflags
-    push r8
-    popfq
-    
-    ; Load segment registers
-    mov r8w, [rsi + 148]   ; ds
-    mov ds, r8w
-    mov r8w, [rsi + 150]   ; es
-    mov es, r8w
-    mov r8w, [rsi + 152]   ; fs
-    mov fs, r8w
-    mov r8w, [rsi + 154]   ; gs
-    mov gs, r8w
-    
-    ; Push new rip onto stack for return
-    mov r8, [rsi + 128]    ; rip
-    push r8
-    
-    ; Finally load rsi
-    mov rsi, [rsi + 32]    ; rsi
-    
-    ; Jump to new task
-    ret
\ No newline at end of file
+global switch_to
+global task_start
+
+extern sched_finish_switch
+extern sched_task_exit
+
+; void switch_to(u64 *prev_rsp, u64 next_rsp)
+; rdi = where to save the old stack pointer, rsi = stack to switch to
+;
+; Only the callee-saved registers are kept here; the caller's compiler has
+; already spilled the rest, and a preempted task's full register set sits
+; in the interrupt frame further up its stack.
+switch_to:
+	push rbp
+	push rbx
+	push r12
+	push r13
+	push r14
+	push r15
+
+	mov [rdi], rsp
+	mov rsp, rsi
+
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rbx
+	pop rbp
+	ret
+
+; First switch_to into a new task returns here, with the entry point in
+; r12 (see create_task). The run queue lock taken by the switching CPU is
+; still held and interrupts are off.
+task_start:
+	call sched_finish_switch
+	sti
+	call r12
+	call sched_task_exit
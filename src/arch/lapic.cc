@@ -4,9 +4,12 @@ import types;
 import arch.io;
 import arch.cpu;
 import arch.idt;
+import arch.time;
 import lib.print;
+import lib.log;
+import lib.spinlock;
+import lib.trace;
 import mm.pframe;
-import sched;
 
 // APIC Base MSR
 #define IA32_APIC_BASE_MSR      0x1B
@@ -39,8 +42,21 @@ import sched;
 #define LAPIC_LVT_TIMER   0x320
 #define LAPIC_LVT_LINT0   0x350
 #define LAPIC_LVT_LINT1   0x360
+#define LVT_DELIVERY_EXTINT     0x700
 #define LAPIC_LVT_ERROR   0x370
 
+// ICR fields
+#define ICR_INIT                0x00500
+#define ICR_STARTUP             0x00600
+#define ICR_SEND_PENDING        0x01000
+#define ICR_LEVEL_ASSERT        0x04000
+#define ICR_LEVEL_TRIGGER       0x08000
+#define ICR_DEST_SHIFT          24
+
+#define LAPIC_LVT_MASKED        (1 << 16)
+#define IA32_TSC_DEADLINE_MSR   0x6E0
+#define CPUID1_ECX_TSC_DEADLINE (1U << 24)
+
 #define LAPIC_ENABLE            0x100
 #define SPURIOUS_VECTOR         0xFF  // Can be any vector from 0x10–0xFE
 
@@ -56,6 +72,7 @@ import sched;
 #define PIC2_DATA    0xA1
 
 #define PIC_EOI      0x20
+#define PIC_READ_ISR 0x0B    // OCW3: next command port read is the ISR
 
 #define ICW1_INIT    0x10
 #define ICW1_ICW4    0x01
@@ -63,7 +80,41 @@ import sched;
 
 uint64_t lapic_base;
 
+static void (*timer_callback)();
+
+// Fast entry stubs in idt_asm.asm
+extern "C" void isr_lapic_timer();
+extern "C" void isr_resched();
+extern "C" void isr_spurious();
+
+static bool     tsc_deadline;       // timer armed through IA32_TSC_DEADLINE
+static uint64_t lapic_timer_hz;     // one-shot count rate after the divider
+static uint64_t lapic_ns_mult;      // count = ns * lapic_ns_mult >> 32
+
+/*
+ * IRQ 7 and 15 are also what an 8259 delivers when a line dropped before
+ * the CPU acknowledged it. Such a spurious IRQ is not in service and gets
+ * no EOI, except that the master did see the cascade for one from the
+ * slave. A real one has no driver, so it is just acknowledged.
+ */
+static void
+pic_spurious_irq( arch::interrupt_context *ctx ) {
+    uint32_t irq = ctx->int_no - 0x20;
+    uint16_t cmd = irq >= 8 ? PIC2_COMMAND : PIC1_COMMAND;
+
+    arch::outb( cmd, PIC_READ_ISR );
+    if( arch::inb( cmd ) & (1 << (irq & 7)) ) {
+        arch::pic_eoi( irq );
+        return;
+    }
+
+    if( irq >= 8 )
+        arch::outb( PIC1_COMMAND, PIC_EOI );
+}
+
 export namespace arch {
+    constexpr auto RESCHED_VECTOR = 0xF0;   // IPI: re-run the scheduler
+
     // Write to LAPIC MMIO
     inline void lapic_write(uint32_t reg, uint32_t value) {
         volatile uint32_t* lapic = (volatile uint32_t*)LAPIC_BASE;
@@ -179,14 +230,108 @@ export namespace arch {
         lapic_write( LAPIC_EOI, no );
     }
     
-    void
-    lapic_timer_handler( arch::interrupt_context *ctx ) {
+    // Entered from isr_lapic_timer, not through handle_interrupt()
+    extern "C" void
+    lapic_timer_interrupt( u64 rip ) {
         static int timer_count = 0;
+
+        trace::emit( trace::EV_IRQ_ENTRY, LAPIC_TIMER_VECTOR, rip );
         if (++timer_count % 1000 == 0) {
-            printk("[TIMER] Timer interrupt %d\n", timer_count);
+            klog::trace<klog::timer>("Timer interrupt %d\n", timer_count);
+            if (lockstat)
+                dump_lock_stats();
         }
-        sched::schedule_from_interrupt(ctx);
+        // EOI first: the switch may not come back here for a while; for
+        // the same reason the trace ends the interrupt here
         lapic_eoi( 0 );
+        trace::emit( trace::EV_IRQ_EXIT, LAPIC_TIMER_VECTOR );
+
+        if (timer_callback)
+            timer_callback();
+    }
+
+    // Called from every timer interrupt once set; the scheduler hooks in here
+    void
+    set_timer_callback( void (*callback)() ) {
+        timer_callback = callback;
+    }
+
+    // Measure the one-shot count rate against 10ms of (calibrated) TSC time
+    void
+    calibrate_lapic_timer() {
+        lapic_write(LAPIC_TIMER_DIV, LAPIC_DIVIDE_BY_16);
+        lapic_write(LAPIC_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_MODE_ONESHOT | LAPIC_TIMER_VECTOR);
+        lapic_write(LAPIC_TIMER_INIT_CNT, 0xFFFFFFFF);
+
+        udelay(10000);
+
+        uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR_CNT);
+        lapic_write(LAPIC_TIMER_INIT_CNT, 0);
+
+        lapic_timer_hz = elapsed * 100UL;
+        lapic_ns_mult  = frac32(lapic_timer_hz, 1000000000UL);
+    }
+
+    // Put this CPU's timer into TSC-deadline or one-shot mode, stopped
+    void
+    setup_lapic_timer() {
+        if (tsc_deadline) {
+            lapic_write(LAPIC_TIMER, LAPIC_TIMER_MODE_TSC | LAPIC_TIMER_VECTOR);
+            // The LVT write must be visible before the first deadline write
+            asm volatile("mfence" ::: "memory");
+        } else {
+            init_lapic_timer(0, false);
+        }
+    }
+
+    // Fire one timer interrupt `ns` nanoseconds from now, replacing any
+    // pending one
+    void
+    lapic_timer_arm_ns( uint64_t ns ) {
+        if (tsc_deadline) {
+            write_msr(IA32_TSC_DEADLINE_MSR, rdtsc() + ns_to_tsc(ns));
+            return;
+        }
+
+        uint64_t count = (unsigned __int128)ns * lapic_ns_mult >> 32;
+        if (count > 0xFFFFFFFF)
+            count = 0xFFFFFFFF;
+        lapic_write(LAPIC_TIMER_INIT_CNT, count ? count : 1);
+    }
+
+    void
+    lapic_timer_stop() {
+        if (tsc_deadline)
+            write_msr(IA32_TSC_DEADLINE_MSR, 0);
+        else
+            lapic_write(LAPIC_TIMER_INIT_CNT, 0);
+    }
+
+    // Send an IPI to the LAPIC with the given ID and wait until it left
+    void
+    lapic_send_ipi( uint32_t apic_id, uint32_t icr ) {
+        lapic_write(LAPIC_ICR_HIGH, apic_id << ICR_DEST_SHIFT);
+        lapic_write(LAPIC_ICR_LOW, icr);
+
+        while (lapic_read(LAPIC_ICR_LOW) & ICR_SEND_PENDING)
+            cpu_relax();
+    }
+
+    void
+    lapic_send_resched( uint32_t apic_id ) {
+        lapic_send_ipi(apic_id, RESCHED_VECTOR);
+    }
+
+    void
+    lapic_send_init( uint32_t apic_id ) {
+        lapic_send_ipi(apic_id, ICR_INIT | ICR_LEVEL_ASSERT | ICR_LEVEL_TRIGGER);
+        lapic_send_ipi(apic_id, ICR_INIT | ICR_LEVEL_TRIGGER);   // deassert
+    }
+
+    // The AP starts executing in real mode at page `vector` (0x000VV000)
+    void
+    lapic_send_startup( uint32_t apic_id, uint8_t vector ) {
+        lapic_send_ipi(apic_id, ICR_STARTUP | vector);
     }
 
     void 
@@ -208,8 +353,43 @@ export namespace arch {
         disable_pic();
 
         route_lapic_interrupts();
-        register_irq_handler( 0x20, lapic_timer_handler );
 
-        init_lapic_timer( 100, true );
+        // Legacy device IRQs: the 8259s (remapped, lines masked until a
+        // handler is registered) feed the BSP's LINT0 in virtual wire mode
+        lapic_write(LAPIC_LVT_LINT0, LVT_DELIVERY_EXTINT);
+
+        // Not register_irq_handler(): the lines stay masked
+        callbacks[0x20 + 7] = pic_spurious_irq;
+        callbacks[0x20 + 15] = pic_spurious_irq;
+
+        // The IDT is shared, so this covers the APs too
+        register_interrupt_handler( LAPIC_TIMER_VECTOR, (void *)isr_lapic_timer, 0, 0x8e );
+        register_interrupt_handler( RESCHED_VECTOR, (void *)isr_resched, 0, 0x8e );
+        register_interrupt_handler( SPURIOUS_VECTOR, (void *)isr_spurious, 0, 0x8e );
+
+        uint32_t eax, ebx, ecx, edx;
+        cpuid( 1, 0, eax, ebx, ecx, edx );
+        tsc_deadline = ecx & CPUID1_ECX_TSC_DEADLINE;
+
+        if (tsc_deadline) {
+            printk( "[LAPIC] timer in TSC-deadline mode\n" );
+        } else {
+            calibrate_lapic_timer();
+            printk( "[LAPIC] timer at %d kHz\n", lapic_timer_hz / 1000 );
+        }
+
+        // Stopped: the scheduler arms it only when needed
+        setup_lapic_timer();
+    }
+
+    // Per-CPU part of init_lapic() for application processors: the PIC
+    // and the timer IRQ handler are already set up by the BSP.
+    void
+    init_lapic_ap() {
+        enable_lapic();
+        init_lapic_internal();
+        route_lapic_interrupts();
+
+        setup_lapic_timer();
     }
 }
@@ -3,7 +3,11 @@ export module arch.ps2;
 import arch.io;
 import arch.cpu;
 import arch.idt;
+import arch.time;
 import types;
+import sched;
+import wait;
+import lib.spinlock;
 
 // ==================== PS/2 Keyboard Port Definitions ====================
 
@@ -77,6 +81,11 @@ typedef struct {
 static key_buffer_t key_buffer = {0};
 static keyboard_state_t kb_state = {0};
 
+// key_buffer is filled by the IRQ handler and drained by readers that
+// sleep on key_wait while it is empty
+static spinlock_t key_lock;
+static wait::wait_queue_t key_wait;
+
 // ==================== Scancode Tables ====================
 
 // Scancode Set 1 (default) - Main keys
@@ -146,30 +155,40 @@ io_wait(void) {
 
 // ==================== PS/2 Controller Functions ====================
 
+// Controller timeouts. A poll or two usually suffices; past that the
+// waiting task sleeps between polls instead of spinning on the port.
+constexpr auto PS2_TIMEOUT_NS   = 500000000UL;
+constexpr auto PS2_POLL_SPIN    = 16;
+constexpr auto PS2_POLL_NS      = 100000UL;
+
+// Wait until (status & mask) == want, or time out
+static bool
+ps2_wait_status( uint8_t mask, uint8_t want ) {
+    auto deadline = arch::ktime_ns() + PS2_TIMEOUT_NS;
+
+    for( auto polls = 0;; polls++ ) {
+        if( (arch::inb(PS2_STATUS_PORT) & mask) == want )
+            return true;
+        if( arch::ktime_ns() >= deadline )
+            return false;
+
+        if( polls < PS2_POLL_SPIN )
+            arch::cpu_relax();
+        else
+            sched::sleep_for( PS2_POLL_NS );
+    }
+}
+
 // Wait for input buffer to be ready (empty)
 static bool 
 ps2_wait_input(void) {
-    uint32_t timeout = 100000;
-    while (timeout--) {
-        if( !(arch::inb(PS2_STATUS_PORT) & PS2_STATUS_INPUT_FULL) ) {
-            return true;
-        }
-        io_wait();
-    }
-    return false;
+    return ps2_wait_status( PS2_STATUS_INPUT_FULL, 0 );
 }
 
 // Wait for output buffer to have data
 static bool 
 ps2_wait_output() {
-    uint32_t timeout = 100000;
-    while( timeout-- ) {
-        if( arch::inb(PS2_STATUS_PORT) & PS2_STATUS_OUTPUT_FULL ) {
-            return true;
-        }
-        io_wait();
-    }
-    return false;
+    return ps2_wait_status( PS2_STATUS_OUTPUT_FULL, PS2_STATUS_OUTPUT_FULL );
 }
 
 // Send command to PS/2 controller
@@ -214,12 +233,108 @@ static void keyboard_update_leds(void) {
     arch::outb(PS2_DATA_PORT, led_status);
 }
 
+// ==================== Key Buffer ====================
+
+// Called with interrupts off; drops the key if the buffer is full
+static void
+key_buffer_push( uint8_t c ) {
+    spinlock_guard guard(key_lock);
+
+    if (key_buffer.count == KEY_BUFFER_SIZE)
+        return;
+
+    key_buffer.buffer[key_buffer.write_index] = c;
+    key_buffer.write_index = (key_buffer.write_index + 1) % KEY_BUFFER_SIZE;
+    key_buffer.count++;
+}
+
+static bool
+key_buffer_pop( uint8_t *c ) {
+    spinlock_irq_guard guard(key_lock);
+
+    if (!key_buffer.count)
+        return false;
+
+    *c = key_buffer.buffer[key_buffer.read_index];
+    key_buffer.read_index = (key_buffer.read_index + 1) % KEY_BUFFER_SIZE;
+    key_buffer.count--;
+    return true;
+}
+
+// Track modifiers and translate a set 1 make code to ASCII, 0 if none
+static uint8_t
+keyboard_translate( uint8_t scancode ) {
+    bool extended = kb_state.extended;
+    kb_state.extended = false;
+
+    if (scancode == 0xE0) {
+        kb_state.extended = true;
+        return 0;
+    }
+
+    bool released = scancode & 0x80;
+    uint8_t key = scancode & 0x7F;
+
+    switch (key) {
+    case KEY_LSHIFT:
+        kb_state.shift_left = !released;
+        return 0;
+    case KEY_RSHIFT:
+        kb_state.shift_right = !released;
+        return 0;
+    case KEY_LCTRL:
+        if (extended) kb_state.ctrl_right = !released;
+        else          kb_state.ctrl_left = !released;
+        return 0;
+    case KEY_LALT:
+        if (extended) kb_state.alt_right = !released;
+        else          kb_state.alt_left = !released;
+        return 0;
+    case KEY_CAPS:
+        if (!released) kb_state.caps_lock = !kb_state.caps_lock;
+        return 0;
+    case KEY_NUM:
+        if (!released) kb_state.num_lock = !kb_state.num_lock;
+        return 0;
+    case KEY_SCROLL:
+        if (!released) kb_state.scroll_lock = !kb_state.scroll_lock;
+        return 0;
+    }
+
+    // Extended codes are cursor and navigation keys, not characters
+    if (released || extended)
+        return 0;
+
+    bool shift = kb_state.shift_left || kb_state.shift_right;
+    char c = shift ? scancode_to_ascii_shifted[key] : scancode_to_ascii_unshifted[key];
+
+    if (kb_state.caps_lock && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+        c ^= 0x20;
+
+    return c;
+}
+
 void
 ps2_irq_handler( arch::interrupt_context *ctx ) {
+    uint8_t c = keyboard_translate(arch::inb(PS2_DATA_PORT));
+
+    arch::pic_eoi(1);
 
+    if (c) {
+        key_buffer_push(c);
+        wait::wake_one(&key_wait);
+    }
 }
 
 export namespace arch {
+    // Next character typed; sleeps without using the CPU until there is one
+    uint8_t
+    ps2_getchar() {
+        uint8_t c;
+        wait::wait_event(&key_wait, [&c] { return key_buffer_pop(&c); });
+        return c;
+    }
+
     bool
     init_ps2() {
         // Disable devices during initialization
@@ -0,0 +1,147 @@
+export module arch.smp;
+
+import types;
+import arch.cpu;
+import arch.gdt;
+import arch.idt;
+import arch.fpu;
+import arch.lapic;
+import arch.time;
+import lib.print;
+import lib.string;
+import mm.pframe;
+import sched;
+
+constexpr auto TRAMPOLINE_BASE = 0x8000UL;   // must match smp_trampoline.asm
+constexpr auto AP_STACK_PAGES  = 4UL;
+constexpr auto IA32_EFER       = 0xC0000080;
+constexpr u32  NO_CPU          = ~0U;
+
+// Layout of smp_trampoline_args in smp_trampoline.asm
+struct [[gnu::packed]] trampoline_args {
+    u32 cr3;
+    u32 efer;
+    u64 stack;
+    u64 entry;
+    u32 cpu;
+};
+
+extern "C" u8 smp_trampoline_start[];
+extern "C" u8 smp_trampoline_end[];
+extern "C" u8 smp_trampoline_args[];
+
+static sched::task_t idle_tasks[MAX_CPU];
+static volatile bool ap_started;
+static u32           ap_waiting = NO_CPU;  // CPU start_aps() still waits for
+static u32           nr_cpus_online = 1;
+
+/*
+ * First C++ code on an application processor, entered from the trampoline
+ * in long mode on the BSP's page tables and a fresh stack. Brings up the
+ * per-CPU state, registers the idle task with the scheduler and idles.
+ */
+extern "C" [[noreturn]] void
+ap_entry( u32 cpu ) {
+    // Too late: start_aps() gave up on this CPU and may have handed the
+    // trampoline arguments to another one. Touch nothing.
+    u32 expected = cpu;
+    if( arch::get_id() != cpu ||
+        !__atomic_compare_exchange_n( &ap_waiting, &expected, NO_CPU, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) ) {
+        arch::disable_interrupts();
+        arch::halt_cpu();
+    }
+
+    arch::set_this_cpu( cpu );
+
+    arch::load_gdt( cpu );
+    arch::load_idt();
+    arch::init_fpu();
+
+    sched::init_kernel_task( &idle_tasks[cpu], sched::IDLE_PRIO );
+    sched::set_current_task( &idle_tasks[cpu] );
+
+    arch::init_lapic_ap();
+
+    printk( "[SMP] CPU %d online\n", cpu );
+    __atomic_store_n( &ap_started, true, __ATOMIC_RELEASE );
+
+    arch::enable_interrupts();
+    arch::halt_cpu();
+}
+
+export namespace arch {
+    /*
+     * Start application processors 0..nr_cores-1 (except the BSP) with the
+     * INIT-SIPI-SIPI sequence, one at a time. The APIC IDs are assumed to
+     * be contiguous and double as CPU indices, as they do on QEMU.
+     */
+    void
+    start_aps( u32 nr_cores, u32 bsp_id ) {
+        if( nr_cores > MAX_CPU ) {
+            printk( "[SMP] %d cores, only starting %d\n", nr_cores, MAX_CPU );
+            nr_cores = MAX_CPU;
+        }
+
+        auto size = smp_trampoline_end - smp_trampoline_start;
+        memcpy( (void *)TRAMPOLINE_BASE, smp_trampoline_start, size );
+
+        auto args  = (trampoline_args *)(TRAMPOLINE_BASE + (smp_trampoline_args - smp_trampoline_start));
+        auto cr3   = (u64)mm::get_current_page_dir();
+
+        // The trampoline loads CR3 while still in 32 bit mode
+        if( cr3 >> 32 )
+            panic( "start_aps: page tables above 4 GiB" );
+
+        args->cr3   = (u32)cr3;
+        args->efer  = (u32)read_msr( IA32_EFER );
+        args->entry = (u64)&ap_entry;
+
+        for( u32 cpu = 0; cpu < nr_cores; cpu++ ) {
+            if( cpu == bsp_id )
+                continue;
+
+            auto stack = mm::phys_alloc_pages( AP_STACK_PAGES );
+            if( stack == (physaddr_t)-1 ) {
+                printk( "[SMP] no stack for CPU %d\n", cpu );
+                break;
+            }
+
+            args->stack = stack + AP_STACK_PAGES * mm::PAGE_SIZE;
+            args->cpu   = cpu;
+            ap_started  = false;
+            __atomic_store_n( &ap_waiting, cpu, __ATOMIC_RELEASE );
+
+            lapic_send_init( cpu );
+            arch::udelay( 10000 );
+
+            // The second STARTUP is only needed if the first one was missed;
+            // after that give the AP up to 200ms to reach ap_entry().
+            for( auto attempt = 0; attempt < 2 && !ap_started; attempt++ ) {
+                lapic_send_startup( cpu, TRAMPOLINE_BASE >> 12 );
+
+                auto timeout = attempt ? 200000 : 200;
+                for( auto us = 0; us < timeout && !__atomic_load_n( &ap_started, __ATOMIC_ACQUIRE ); us += 10 )
+                    arch::udelay( 10 );
+            }
+
+            if( !ap_started ) {
+                // Give up unless the AP made it into ap_entry() meanwhile.
+                // A late one may still be in the trampoline on `stack`, so
+                // INIT parks it and the stack is never freed.
+                u32 expected = cpu;
+                if( __atomic_compare_exchange_n( &ap_waiting, &expected, NO_CPU, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+                    printk( "[SMP] CPU %d did not respond\n", cpu );
+                    lapic_send_init( cpu );
+                    continue;
+                }
+
+                while( !__atomic_load_n( &ap_started, __ATOMIC_ACQUIRE ) )
+                    cpu_relax();
+            }
+
+            nr_cpus_online++;
+        }
+
+        printk( "[SMP] %d of %d CPU(s) online\n", nr_cpus_online, nr_cores );
+    }
+}
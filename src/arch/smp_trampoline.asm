@@ -0,0 +1,88 @@
+; Application processor start-up code.
+;
+; arch::start_aps() copies everything between smp_trampoline_start and
+; smp_trampoline_end to TRAMPOLINE_BASE and points the STARTUP IPI at it.
+; The AP starts in real mode at TRAMPOLINE_BASE:0000, so every address
+; below is rebased with TRAMP() instead of relying on the link address.
+
+TRAMPOLINE_BASE equ 0x8000
+
+%define TRAMP(x) (TRAMPOLINE_BASE + (x) - smp_trampoline_start)
+
+section .text
+
+global smp_trampoline_start
+global smp_trampoline_end
+global smp_trampoline_args
+
+bits 16
+smp_trampoline_start:
+	cli
+	cld
+	xor ax, ax
+	mov ds, ax
+
+	lgdt [TRAMP(tramp_gdt_ptr)]
+
+	mov eax, cr0
+	or eax, 1                       ; PE
+	mov cr0, eax
+	jmp dword 0x08:TRAMP(tramp_pm32)
+
+bits 32
+tramp_pm32:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+
+	mov eax, cr4
+	or eax, 1 << 5                  ; PAE
+	mov cr4, eax
+
+	mov eax, [TRAMP(tramp_cr3)]     ; the BSP's page tables
+	mov cr3, eax
+
+	mov ecx, 0xC0000080             ; EFER, copied from the BSP (LME, NXE)
+	rdmsr
+	mov eax, [TRAMP(tramp_efer)]
+	wrmsr
+
+	mov eax, cr0
+	or eax, 0x80000001              ; PG | PE
+	mov cr0, eax
+	jmp 0x18:TRAMP(tramp_lm64)
+
+bits 64
+tramp_lm64:
+	xor eax, eax
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+
+	mov rsp, [dword TRAMP(tramp_stack)]
+	mov edi, [dword TRAMP(tramp_cpu)]
+	mov rax, [dword TRAMP(tramp_entry)]
+	push 0                          ; ap_entry never returns
+	jmp rax
+
+align 8
+tramp_gdt:
+	dq 0
+	dq 0x00CF9A000000FFFF           ; 0x08: 32 bit code
+	dq 0x00CF92000000FFFF           ; 0x10: data
+	dq 0x00AF9A000000FFFF           ; 0x18: 64 bit code
+tramp_gdt_ptr:
+	dw tramp_gdt_ptr - tramp_gdt - 1
+	dd TRAMP(tramp_gdt)
+
+; Filled in by the BSP for each AP, see trampoline_args in smp.cc
+align 8
+smp_trampoline_args:
+tramp_cr3:      dd 0
+tramp_efer:     dd 0
+tramp_stack:    dq 0
+tramp_entry:    dq 0
+tramp_cpu:      dd 0
+
+smp_trampoline_end:
@@ -0,0 +1,139 @@
+export module arch.time;
+
+import types;
+import arch.io;
+import arch.cpu;
+import lib.print;
+
+// Time base. The TSC frequency comes from CPUID leaf 0x15 (crystal ratio)
+// or 0x16 (nominal frequency) where the CPU reports it, otherwise it is
+// measured against PIT channel 2. The TSC is assumed to be invariant and
+// synchronised between CPUs, as it is on everything we run on.
+constexpr auto NSEC_PER_SEC     = 1000000000UL;
+constexpr auto PIT_HZ           = 1193182UL;
+constexpr auto PIT_CALIBRATE_MS = 10UL;
+
+constexpr auto PIT_CH2_DATA     = 0x42;
+constexpr auto PIT_COMMAND      = 0x43;
+constexpr auto PIT_GATE         = 0x61;     // bit 0: ch2 gate, 1: speaker, 5: ch2 output
+
+// Not static: the inline conversions below are expanded in importers
+u64 tsc_hz;
+u64 tsc_base;
+u64 ns_mult;                // ns = tsc * ns_mult >> 32
+u64 tsc_mult;               // tsc = ns * tsc_mult >> 32
+
+// Busy-wait `ms` (at most 54) milliseconds on PIT channel 2
+static void
+pit_wait_ms( u64 ms ) {
+    u32 count = PIT_HZ * ms / 1000;
+
+    // Gate low, speaker off; mode 0 raises OUT2 at the terminal count
+    u8 gate = arch::inb( PIT_GATE ) & ~0x03;
+    arch::outb( PIT_GATE, gate );
+    arch::outb( PIT_COMMAND, 0xB0 );    // channel 2, lobyte/hibyte, mode 0
+    arch::outb( PIT_CH2_DATA, count & 0xFF );
+    arch::outb( PIT_CH2_DATA, count >> 8 );
+    arch::outb( PIT_GATE, gate | 0x01 );
+
+    while( !(arch::inb( PIT_GATE ) & 0x20) )
+        arch::cpu_relax();
+}
+
+// Best of three, so an SMI or a preempted vCPU only makes a run longer
+static u64
+pit_calibrate_tsc() {
+    u64 best = ~0UL;
+
+    for( auto i = 0; i < 3; i++ ) {
+        u64 start = arch::rdtsc();
+        pit_wait_ms( PIT_CALIBRATE_MS );
+        u64 delta = arch::rdtsc() - start;
+
+        if( delta < best )
+            best = delta;
+    }
+
+    return best * (1000 / PIT_CALIBRATE_MS);
+}
+
+static u64
+cpuid_tsc_hz() {
+    u32 max, eax, ebx, ecx, edx;
+
+    arch::cpuid( 0, 0, max, ebx, ecx, edx );
+
+    if( max >= 0x15 ) {
+        arch::cpuid( 0x15, 0, eax, ebx, ecx, edx );
+        if( eax && ebx && ecx )
+            return (u64)ecx * ebx / eax;
+    }
+
+    if( max >= 0x16 ) {
+        arch::cpuid( 0x16, 0, eax, ebx, ecx, edx );
+        if( eax & 0xFFFF )
+            return (u64)(eax & 0xFFFF) * 1000000;
+    }
+
+    return 0;
+}
+
+export namespace arch {
+    // (a << 32) / b without a 128 bit division, for x * a / b as a
+    // multiply and shift. a % b must fit in 32 bits.
+    inline u64
+    frac32( u64 a, u64 b ) {
+        return ((a / b) << 32) + ((a % b) << 32) / b;
+    }
+
+    void
+    init_time() {
+        const char *source = "CPUID";
+
+        tsc_hz = cpuid_tsc_hz();
+        if( !tsc_hz ) {
+            tsc_hz = pit_calibrate_tsc();
+            source = "PIT";
+        }
+
+        tsc_base = rdtsc();
+        ns_mult  = frac32( NSEC_PER_SEC, tsc_hz );
+        tsc_mult = frac32( tsc_hz, NSEC_PER_SEC );
+
+        printk( "[TIME] TSC at %d kHz (%s)\n", tsc_hz / 1000, source );
+    }
+
+    inline u64
+    tsc_frequency() {
+        return tsc_hz;
+    }
+
+    inline u64
+    tsc_to_ns( u64 cycles ) {
+        return (unsigned __int128)cycles * ns_mult >> 32;
+    }
+
+    inline u64
+    ns_to_tsc( u64 ns ) {
+        return (unsigned __int128)ns * tsc_mult >> 32;
+    }
+
+    // Nanoseconds since init_time(), monotonic and the same on every CPU
+    inline u64
+    ktime_ns() {
+        return tsc_to_ns( rdtsc() - tsc_base );
+    }
+
+    void
+    ndelay( u64 ns ) {
+        u64 end = rdtsc() + ns_to_tsc( ns );
+
+        while( rdtsc() < end )
+            cpu_relax();
+    }
+
+    void
+    udelay( u64 us ) {
+        ndelay( us * 1000 );
+    }
+}
@@ -0,0 +1,257 @@
+export module arch.uart;
+
+import types;
+import arch.io;
+import arch.cpu;
+import arch.idt;
+import lib.print;
+import lib.spinlock;
+import wait;
+
+// Interrupt-driven 16550 driver for COM1. Output is queued in tx_buf and
+// moved to the UART a FIFO load (16 bytes) per THR-empty interrupt, input
+// is collected from RX interrupts into rx_buf for uart_getchar(). Nobody
+// waits for the line, except panic() through uart_sync(). Once tx_buf runs
+// dry the interrupt refills it from the printk rings.
+constexpr u16 COM1          = 0x3F8;
+constexpr u32 COM1_IRQ      = 4;
+constexpr u32 COM1_VECTOR   = 0x20 + COM1_IRQ;
+
+constexpr u16 UART_DATA     = 0;        // RBR / THR, DLL with DLAB
+constexpr u16 UART_IER      = 1;        // DLM with DLAB
+constexpr u16 UART_IIR      = 2;        // read
+constexpr u16 UART_FCR      = 2;        // write
+constexpr u16 UART_LCR      = 3;
+constexpr u16 UART_MCR      = 4;
+constexpr u16 UART_LSR      = 5;
+constexpr u16 UART_MSR      = 6;
+
+constexpr u8 IER_RX         = 0x01;
+constexpr u8 IER_THRE       = 0x02;
+constexpr u8 IER_LSR        = 0x04;
+
+constexpr u8 IIR_NONE       = 0x01;     // no interrupt pending
+constexpr u8 IIR_ID_MASK    = 0x0E;
+constexpr u8 IIR_MSR        = 0x00;
+constexpr u8 IIR_THRE       = 0x02;
+constexpr u8 IIR_RX         = 0x04;
+constexpr u8 IIR_LSR        = 0x06;
+constexpr u8 IIR_RX_TIMEOUT = 0x0C;
+constexpr u8 IIR_FIFO_ON    = 0xC0;
+
+constexpr u8 FCR_ENABLE     = 0x01;
+constexpr u8 FCR_CLEAR_RX   = 0x02;
+constexpr u8 FCR_CLEAR_TX   = 0x04;
+constexpr u8 FCR_TRIGGER_14 = 0xC0;
+
+constexpr u8 LCR_8N1        = 0x03;
+constexpr u8 LCR_DLAB       = 0x80;
+constexpr u8 MCR_DTR_RTS    = 0x03;
+constexpr u8 MCR_OUT2       = 0x08;     // gates the IRQ line on PCs
+constexpr u8 LSR_DR         = 0x01;
+constexpr u8 LSR_THRE       = 0x20;
+
+constexpr u32 UART_CLOCK    = 115200;   // 1.8432 MHz / 16
+constexpr u32 UART_BAUD     = 115200;
+constexpr u32 UART_FIFO     = 16;
+
+constexpr u64 TX_SIZE       = 4096;     // powers of two
+constexpr u64 RX_SIZE       = 1024;
+
+static spinlock_t         uart_lock{ "uart" };
+static char               tx_buf[TX_SIZE];
+static u64                tx_head, tx_tail;   // free running
+static bool               tx_active;          // a THRE interrupt is due
+static bool               tx_irq_seen;        // THRE interrupts get through
+static char               rx_buf[RX_SIZE];
+static u64                rx_head, rx_tail;
+static u64                rx_dropped;
+static u32                fifo_size = 1;
+static wait::wait_queue_t rx_wait;
+
+static inline u8
+uart_in( u16 reg ) {
+    return arch::inb( COM1 + reg );
+}
+
+static inline void
+uart_out( u16 reg, u8 value ) {
+    arch::outb( COM1 + reg, value );
+}
+
+// Refill the empty transmitter with up to one FIFO load. Caller holds
+// uart_lock.
+static void
+tx_fill() {
+    u32 n = 0;
+
+    for( ; n < fifo_size && tx_tail != tx_head; n++ )
+        uart_out( UART_DATA, tx_buf[tx_tail++ & (TX_SIZE - 1)] );
+
+    tx_active = n != 0;
+}
+
+// Drain the RX FIFO into rx_buf. Caller holds uart_lock.
+static bool
+rx_collect() {
+    bool got = false;
+
+    while( uart_in( UART_LSR ) & LSR_DR ) {
+        char c = uart_in( UART_DATA );
+
+        if( rx_head - rx_tail == RX_SIZE ) {
+            rx_dropped++;
+            continue;
+        }
+        rx_buf[rx_head++ & (RX_SIZE - 1)] = c;
+        got = true;
+    }
+
+    return got;
+}
+
+static bool
+rx_pop( char *c ) {
+    spinlock_irq_guard guard( uart_lock );
+
+    if( rx_tail == rx_head )
+        return false;
+
+    *c = rx_buf[rx_tail++ & (RX_SIZE - 1)];
+    return true;
+}
+
+static void
+uart_irq( arch::interrupt_context *ctx ) {
+    bool woke  = false;
+    bool empty = false;
+
+    uart_lock.lock();
+
+    for( ;; ) {
+        u8 iir = uart_in( UART_IIR );
+        if( iir & IIR_NONE )
+            break;
+
+        switch( iir & IIR_ID_MASK ) {
+        case IIR_RX:
+        case IIR_RX_TIMEOUT:
+            woke |= rx_collect();
+            break;
+        case IIR_THRE:
+            tx_irq_seen = true;
+            tx_fill();
+            empty = tx_tail == tx_head;
+            break;
+        case IIR_LSR:
+            uart_in( UART_LSR );
+            break;
+        case IIR_MSR:
+            uart_in( UART_MSR );
+            break;
+        }
+    }
+
+    uart_lock.release();
+    arch::pic_eoi( COM1_IRQ );
+
+    if( woke )
+        wait::wake_all( &rx_wait );
+
+    // Comes back through uart_write(), so not under uart_lock
+    if( empty )
+        log_flush();
+}
+
+export namespace arch {
+    /*
+     * Queue up to `len` bytes for output and return how many fit. Never
+     * waits; the THRE interrupt takes it from here.
+     */
+    u64
+    uart_write( const char *buf, u64 len ) {
+        auto flags = uart_lock.lock_irqsave();
+
+        u64 room = TX_SIZE - (tx_head - tx_tail);
+        if( len > room )
+            len = room;
+
+        for( u64 i = 0; i < len; i++ )
+            tx_buf[tx_head++ & (TX_SIZE - 1)] = buf[i];
+
+        if( !tx_irq_seen ) {
+            // Interrupts have been off since init_uart() (boot), write it
+            // out now so a hang before enable_interrupts() still shows
+            while( tx_tail != tx_head ) {
+                while( !(uart_in( UART_LSR ) & LSR_THRE) )
+                    cpu_relax();
+                tx_fill();
+            }
+        } else if( uart_in( UART_LSR ) & LSR_THRE ) {
+            // An idle transmitter raises no THRE interrupt, start it here.
+            // Not trusting tx_active: its interrupt may still be pending.
+            tx_fill();
+        }
+
+        uart_lock.release_irqrestore( flags );
+        return len;
+    }
+
+    // Push out everything queued by polling, with interrupts off and
+    // without the lock: for panic(), when the lock holder may be dead
+    void
+    uart_sync() {
+        auto flags = irq_save();
+
+        while( tx_tail != tx_head ) {
+            while( !(uart_in( UART_LSR ) & LSR_THRE) )
+                cpu_relax();
+            tx_fill();
+        }
+
+        irq_restore( flags );
+    }
+
+    // Next received byte, -1 if none
+    int
+    uart_try_getchar() {
+        char c;
+        return rx_pop( &c ) ? (u8)c : -1;
+    }
+
+    // Next received byte; sleeps without using the CPU until there is one
+    u8
+    uart_getchar() {
+        char c;
+        wait::wait_event( &rx_wait, [&c] { return rx_pop( &c ); } );
+        return c;
+    }
+
+    /*
+     * Program COM1 for 115200 8N1 with FIFOs, take over its IRQ and make it
+     * the printk console. Needs the PIC set up by init_lapic().
+     */
+    void
+    init_uart() {
+        uart_out( UART_IER, 0 );
+
+        u16 divisor = UART_CLOCK / UART_BAUD;
+        uart_out( UART_LCR, LCR_DLAB );
+        uart_out( UART_DATA, divisor & 0xFF );
+        uart_out( UART_IER, divisor >> 8 );
+        uart_out( UART_LCR, LCR_8N1 );
+
+        // Only a 16550A and later reports working FIFOs
+        uart_out( UART_FCR, FCR_ENABLE | FCR_CLEAR_RX | FCR_CLEAR_TX | FCR_TRIGGER_14 );
+        fifo_size = (uart_in( UART_IIR ) & IIR_FIFO_ON) == IIR_FIFO_ON ? UART_FIFO : 1;
+
+        uart_out( UART_MCR, MCR_DTR_RTS | MCR_OUT2 );
+
+        register_irq_handler( COM1_VECTOR, uart_irq );
+        uart_out( UART_IER, IER_RX | IER_THRE | IER_LSR );
+
+        set_console( uart_write, uart_sync );
+
+        printk( "[UART] COM1 at %d baud, %d byte FIFO\n", UART_BAUD, fifo_size );
+    }
+}
@@ -0,0 +1,103 @@
+export module lib.log;
+
+import types;
+import lib.print;
+
+#include <stdarg.h>
+
+// Log levels, fixed at compile time. Each subsystem has its own threshold,
+// LOG_LEVEL by default; a message above it is discarded by `if constexpr`
+// and compiles to nothing, format string included. Build with e.g.
+// `make LOG_LEVEL=4` for debug output everywhere, or add
+// -DLOG_LEVEL_SCHED=5 to CXXFLAGS to trace only the scheduler.
+#define LOG_NONE    0
+#define LOG_ERROR   1
+#define LOG_WARN    2
+#define LOG_INFO    3
+#define LOG_DEBUG   4
+#define LOG_TRACE   5
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+#ifndef LOG_LEVEL_SCHED
+#define LOG_LEVEL_SCHED LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_TIMER
+#define LOG_LEVEL_TIMER LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_HEAP
+#define LOG_LEVEL_HEAP LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_SLAB
+#define LOG_LEVEL_SLAB LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_PHYSMM
+#define LOG_LEVEL_PHYSMM LOG_LEVEL
+#endif
+
+export namespace klog {
+    enum level_t : u8 {
+        NONE  = LOG_NONE,
+        ERROR = LOG_ERROR,
+        WARN  = LOG_WARN,
+        INFO  = LOG_INFO,
+        DEBUG = LOG_DEBUG,
+        TRACE = LOG_TRACE,
+    };
+
+    // Subsystem tags: the "[tag]" prefix and the compile-time threshold
+    struct sched  { static constexpr auto tag = "SCHED";  static constexpr level_t level = (level_t)LOG_LEVEL_SCHED; };
+    struct timer  { static constexpr auto tag = "TIMER";  static constexpr level_t level = (level_t)LOG_LEVEL_TIMER; };
+    struct heap   { static constexpr auto tag = "HEAP";   static constexpr level_t level = (level_t)LOG_LEVEL_HEAP; };
+    struct slab   { static constexpr auto tag = "SLAB";   static constexpr level_t level = (level_t)LOG_LEVEL_SLAB; };
+    struct physmm { static constexpr auto tag = "PhysMM"; static constexpr level_t level = (level_t)LOG_LEVEL_PHYSMM; };
+
+    template<typename Subsys, level_t Level>
+    constexpr bool enabled = Level != NONE && Level <= Subsys::level;
+
+    void
+    write( const char *tag, const char *fmt, ... ) {
+        va_list va;
+
+        va_start( va, fmt );
+        vprintk( tag, fmt, va );
+        va_end( va );
+    }
+
+    template<typename Subsys, typename... Args>
+    inline void
+    error( const char *fmt, Args... args ) {
+        if constexpr( enabled<Subsys, ERROR> )
+            write( Subsys::tag, fmt, args... );
+    }
+
+    template<typename Subsys, typename... Args>
+    inline void
+    warn( const char *fmt, Args... args ) {
+        if constexpr( enabled<Subsys, WARN> )
+            write( Subsys::tag, fmt, args... );
+    }
+
+    template<typename Subsys, typename... Args>
+    inline void
+    info( const char *fmt, Args... args ) {
+        if constexpr( enabled<Subsys, INFO> )
+            write( Subsys::tag, fmt, args... );
+    }
+
+    template<typename Subsys, typename... Args>
+    inline void
+    debug( const char *fmt, Args... args ) {
+        if constexpr( enabled<Subsys, DEBUG> )
+            write( Subsys::tag, fmt, args... );
+    }
+
+    template<typename Subsys, typename... Args>
+    inline void
+    trace( const char *fmt, Args... args ) {
+        if constexpr( enabled<Subsys, TRACE> )
+            write( Subsys::tag, fmt, args... );
+    }
+}
@@ -3,6 +3,7 @@ export module lib.print;
 import types;
 import arch.io;
 import arch.cpu;
+import lib.trace;
 
 #define PRINTF_SUPPORT_DECIMAL_SPECIFIERS 0
 #define PRINTF_SUPPORT_EXPONENTIAL_SPECIFIERS 0
@@ -25,24 +26,181 @@ import arch.cpu;
 
 #include <stb_sprintf.h>
 
+// Kernel log: printk formats a line and appends it to this CPU's ring with
+// interrupts off, so every ring has exactly one writer and needs no lock.
+// It then hands the console what it takes (see log_flush()). Until a
+// console driver registers that means polling COM1; after it nobody waits
+// for the UART, which pulls the rest from its TX interrupt once it has
+// room. A full ring drops the line and counts it.
+constexpr u64 LOG_RING_SIZE = 8192;        // power of two
+constexpr u64 LOG_RING_MASK = LOG_RING_SIZE - 1;
+
+struct alignas(64) log_ring_t {
+    u64  head;                  // written up to here, owned by the CPU
+    u64  tail;                  // drained up to here, owned by the drainer
+    u64  dropped;
+    char buf[LOG_RING_SIZE];
+};
+
+static log_ring_t log_rings[MAX_CPU];
+static bool       log_draining;     // one drainer at a time
+static bool       log_kick;         // output arrived while draining
+
+// Console driver, see set_console(); COM1 by polling until there is one
+static u64  (*console_write)( const char *buf, u64 len );
+static void (*console_sync)();
+
+static void
+log_append( const char *msg, u64 len ) {
+    auto flags = arch::irq_save();
+    auto ring  = &log_rings[arch::this_cpu()];
+    u64  head  = ring->head;
+    u64  tail  = __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE );
+
+    if( LOG_RING_SIZE - (head - tail) < len ) {
+        __atomic_fetch_add( &ring->dropped, 1, __ATOMIC_RELAXED );
+    } else {
+        for( u64 i = 0; i < len; i++ )
+            ring->buf[(head + i) & LOG_RING_MASK] = msg[i];
+        __atomic_store_n( &ring->head, head + len, __ATOMIC_RELEASE );
+    }
+
+    arch::irq_restore( flags );
+}
+
+static void
+write_serial_str( const char *s ) {
+    while( *s )
+        arch::write_serial( *s++ );
+}
+
+// Returns how much the console took
+static u64
+console_put( const char *buf, u64 len ) {
+    if( console_write )
+        return console_write( buf, len );
+
+    for( u64 i = 0; i < len; i++ )
+        arch::write_serial( buf[i] );
+    return len;
+}
+
+// Write out what the console accepts of every CPU's ring
+static bool
+log_drain() {
+    bool wrote = false;
+
+    for( u32 cpu = 0; cpu < MAX_CPU; cpu++ ) {
+        auto ring = &log_rings[cpu];
+        u64  tail = ring->tail;
+        u64  head = __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE );
+
+        while( tail != head ) {
+            u64 off  = tail & LOG_RING_MASK;
+            u64 len  = head - tail < LOG_RING_SIZE - off ? head - tail : LOG_RING_SIZE - off;
+            u64 done = console_put( ring->buf + off, len );
+
+            tail  += done;
+            wrote |= done != 0;
+            if( done < len )
+                break;
+        }
+        __atomic_store_n( &ring->tail, tail, __ATOMIC_RELEASE );
+
+        if( tail == head && __atomic_load_n( &ring->dropped, __ATOMIC_RELAXED ) ) {
+            u64  dropped = __atomic_exchange_n( &ring->dropped, 0, __ATOMIC_RELAXED );
+            char buf[64];
+            int  len = stbsp_snprintf( buf, sizeof(buf), "[LOG] CPU %d dropped %llu line(s)\n", cpu, dropped );
+            console_put( buf, len );
+        }
+    }
+
+    return wrote;
+}
+
 export {
+    /*
+     * Hand the log rings to the console, as far as it takes them. Safe from
+     * interrupt context. If another CPU is already draining, leave it a
+     * note to go round once more instead of waiting. The flag is only held
+     * with interrupts off: a drainer preempted while holding it would
+     * silence the console until it ran again. With a console driver the
+     * drain only copies into its TX buffer, so that stays short.
+     * Returns whether anything was written here.
+     */
+    bool
+    log_flush() {
+        bool wrote = false;
+        auto flags = arch::irq_save();
+
+        do {
+            if( __atomic_exchange_n( &log_draining, true, __ATOMIC_SEQ_CST ) ) {
+                __atomic_store_n( &log_kick, true, __ATOMIC_SEQ_CST );
+                break;
+            }
+
+            wrote |= log_drain();
+            __atomic_store_n( &log_draining, false, __ATOMIC_SEQ_CST );
+        } while( __atomic_exchange_n( &log_kick, false, __ATOMIC_SEQ_CST ) );
+
+        arch::irq_restore( flags );
+        return wrote;
+    }
+
+    /*
+     * Send log output to a console driver. `write` queues what it can of
+     * `len` bytes without blocking and returns how many it took; `sync`
+     * pushes out everything queued by polling, for panic().
+     */
+    void
+    set_console( u64 (*write)( const char *buf, u64 len ), void (*sync)() ) {
+        console_sync  = sync;
+        console_write = write;
+    }
+
+    // Format into one buffer, prefixed with "[tag] " unless `tag` is null,
+    // so a line from one CPU is not split by another's output
+    void
+    vprintk( const char *tag, const char *fmt, va_list va ) {
+        char buf[1024];
+        int  len = 0;
+
+        if( tag )
+            len = stbsp_snprintf( buf, sizeof(buf), "[%s] ", tag );
+        len += stbsp_vsnprintf( buf + len, sizeof(buf) - len, fmt, va );
+
+        log_append( buf, len < (int)sizeof(buf) ? len : sizeof(buf) - 1 );
+        log_flush();
+    }
+
     void
     printk( const char *fmt, ... ) {
         va_list va;
-        char buf[1024];
 
         va_start( va, fmt );
-        stbsp_vsnprintf( buf, 1024, fmt, va );
+        vprintk( nullptr, fmt, va );
         va_end( va );
-
-        char *p = buf;
-        while( *p )
-            arch::write_serial( *p++ );
     }
 
+    // Dump whatever the rings still hold, even if the drainer died with
+    // the lock held, then stop
     void
     panic( const char *msg ) {
-        printk( "Kernel panic: %s\n", msg );
+        arch::disable_interrupts();
+
+        // Whatever the console driver holds first, then poll COM1 directly
+        if( console_sync )
+            console_sync();
+        console_write = nullptr;
+
+        log_drain();
+        write_serial_str( "Kernel panic: " );
+        write_serial_str( msg );
+        write_serial_str( "\n" );
+
+        if( trace::active() )
+            trace::dump();
+
         arch::halt_cpu();
     }
 }
@@ -1,36 +1,255 @@
 export module lib.spinlock;
 
+import types;
 import arch.cpu;
+import lib.print;
 
+constexpr u32 BACKOFF_MAX = 256;
+
+// Set by the "lockstat" kernel command line option: dump the lock
+// statistics periodically. Only has an effect in SPINLOCK_STATS builds.
+export bool lockstat = false;
+
+#ifdef SPINLOCK_STATS
+// Per-lock counters, compiled in with `make LOCKSTAT=1`. Cycle counts come
+// from rdtsc. All fields except `next_lock` are written by the lock holder.
+export struct lock_stats_t {
+    const char   *name;
+    lock_stats_t *next_lock;
+    u64           acquisitions;
+    u64           contended;
+    u64           spin_cycles;
+    u64           max_hold;
+    u64           hold_start;
+    bool          registered;
+};
+
+// Every lock that has been taken at least once
+lock_stats_t *lock_stats_list = nullptr;
+
+void
+register_lock_stats( lock_stats_t *stats ) {
+    stats->registered = true;
+    stats->next_lock  = __atomic_load_n( &lock_stats_list, __ATOMIC_RELAXED );
+    while( !__atomic_compare_exchange_n( &lock_stats_list, &stats->next_lock, stats, true,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+        ;
+}
+#endif
+
+// Spin for `backoff` pause instructions, then double it up to BACKOFF_MAX.
+inline void
+spin_backoff( u32 &backoff ) {
+    for( u32 i = 0; i < backoff; i++ )
+        arch::cpu_relax();
+
+    if( backoff < BACKOFF_MAX )
+        backoff <<= 1;
+}
+
+/*
+ * Ticket lock: every locker draws a ticket and waits until `owner` reaches
+ * it, so the lock is handed out in FIFO order.
+ */
 export class spinlock_t {
 private:
-    // Lock flag: 0 = unlocked, 1 = locked
-    volatile int locked = 0;
+    u32 next  = 0;  // next ticket to hand out
+    u32 owner = 0;  // ticket currently holding the lock
+
+#ifdef SPINLOCK_STATS
+    lock_stats_t stats = {};
+
+    inline void account_acquire( u64 start, bool contended ) {
+        u64 now = arch::rdtsc();
+
+        if( !stats.registered )
+            register_lock_stats( &stats );
+
+        stats.acquisitions++;
+        if( contended ) {
+            stats.contended++;
+            stats.spin_cycles += now - start;
+        }
+        stats.hold_start = now;
+    }
+
+    inline void account_release() {
+        u64 hold = arch::rdtsc() - stats.hold_start;
+        if( hold > stats.max_hold )
+            stats.max_hold = hold;
+    }
+#endif
 
 public:
     spinlock_t() = default;
 
+    // The name only shows up in the lock statistics
+    constexpr explicit spinlock_t( [[maybe_unused]] const char *name ) {
+#ifdef SPINLOCK_STATS
+        stats.name = name;
+#endif
+    }
+
     inline void lock() {
-        while (true) {
-            int expected = 0;
-            // xchg sets locked = 1 and returns old value in expected
-            
-            if (expected == 0) {
-                // Successfully acquired lock
-                break;
-            }
-            // Spin
-
-            arch::halt_cpu();;
+#ifdef SPINLOCK_STATS
+        u64  start     = arch::rdtsc();
+        bool contended = false;
+#endif
+        u32 ticket  = __atomic_fetch_add( &next, 1, __ATOMIC_RELAXED );
+        u32 backoff = 1;
+
+        while( __atomic_load_n( &owner, __ATOMIC_ACQUIRE ) != ticket ) {
+#ifdef SPINLOCK_STATS
+            contended = true;
+#endif
+            spin_backoff( backoff );
         }
+
+#ifdef SPINLOCK_STATS
+        account_acquire( start, contended );
+#endif
+    }
+
+    inline bool try_lock() {
+        u32 cur = __atomic_load_n( &owner, __ATOMIC_RELAXED );
+        u32 expected = cur;
+
+        bool locked = __atomic_compare_exchange_n( &next, &expected, cur + 1, false,
+                                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED );
+#ifdef SPINLOCK_STATS
+        if( locked )
+            account_acquire( 0, false );
+#endif
+        return locked;
     }
 
     inline void release() {
-        asm volatile("" ::: "memory"); // Compiler barrier
-        locked = 0;
+#ifdef SPINLOCK_STATS
+        account_release();
+#endif
+        __atomic_store_n( &owner, owner + 1, __ATOMIC_RELEASE );
+    }
+
+    inline bool is_locked() {
+        return __atomic_load_n( &owner, __ATOMIC_RELAXED ) != __atomic_load_n( &next, __ATOMIC_RELAXED );
+    }
+
+    // For locks also taken from interrupt handlers: interrupts stay off
+    // while the lock is held, the returned flags restore the caller's IF.
+    inline u64 lock_irqsave() {
+        u64 flags = arch::irq_save();
+        lock();
+        return flags;
+    }
+
+    inline void release_irqrestore( u64 flags ) {
+        release();
+        arch::irq_restore( flags );
     }
 
     // Non-copyable, non-movable
     spinlock_t(const spinlock_t&) = delete;
     spinlock_t& operator=(const spinlock_t&) = delete;
-};
\ No newline at end of file
+};
+
+// Scoped spinlock_t::lock()/release().
+export class spinlock_guard {
+private:
+    spinlock_t &lock;
+
+public:
+    explicit spinlock_guard( spinlock_t &lock ) : lock( lock ) {
+        lock.lock();
+    }
+
+    ~spinlock_guard() {
+        lock.release();
+    }
+
+    spinlock_guard(const spinlock_guard&) = delete;
+    spinlock_guard& operator=(const spinlock_guard&) = delete;
+};
+
+// Scoped lock_irqsave()/release_irqrestore().
+export class spinlock_irq_guard {
+private:
+    spinlock_t &lock;
+    u64         flags;
+
+public:
+    explicit spinlock_irq_guard( spinlock_t &lock ) : lock( lock ), flags( lock.lock_irqsave() ) {
+    }
+
+    ~spinlock_irq_guard() {
+        lock.release_irqrestore( flags );
+    }
+
+    spinlock_irq_guard(const spinlock_irq_guard&) = delete;
+    spinlock_irq_guard& operator=(const spinlock_irq_guard&) = delete;
+};
+
+/*
+ * MCS queue lock for contended locks: each waiter spins on the `locked`
+ * flag of its own node, so a release touches one remote cache line instead
+ * of every waiter's. The node must stay valid until release().
+ */
+export struct alignas(64) mcs_node_t {
+    mcs_node_t *next;
+    u32         locked;
+};
+
+export class mcs_lock_t {
+private:
+    mcs_node_t *tail = nullptr;
+
+public:
+    mcs_lock_t() = default;
+
+    inline void lock( mcs_node_t *node ) {
+        node->next   = nullptr;
+        node->locked = 1;
+
+        auto prev = __atomic_exchange_n( &tail, node, __ATOMIC_ACQ_REL );
+        if( !prev )
+            return;
+
+        __atomic_store_n( &prev->next, node, __ATOMIC_RELEASE );
+
+        u32 backoff = 1;
+        while( __atomic_load_n( &node->locked, __ATOMIC_ACQUIRE ) )
+            spin_backoff( backoff );
+    }
+
+    inline void release( mcs_node_t *node ) {
+        auto next = __atomic_load_n( &node->next, __ATOMIC_ACQUIRE );
+
+        if( !next ) {
+            auto expected = node;
+            if( __atomic_compare_exchange_n( &tail, &expected, nullptr, false,
+                                             __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+                return;
+
+            // A successor swapped itself in but has not linked up yet
+            while( !(next = __atomic_load_n( &node->next, __ATOMIC_ACQUIRE )) )
+                arch::cpu_relax();
+        }
+
+        __atomic_store_n( &next->locked, 0, __ATOMIC_RELEASE );
+    }
+
+    // Non-copyable, non-movable
+    mcs_lock_t(const mcs_lock_t&) = delete;
+    mcs_lock_t& operator=(const mcs_lock_t&) = delete;
+};
+
+export void
+dump_lock_stats() {
+#ifdef SPINLOCK_STATS
+    printk( "[LOCKSTAT] %-16s %12s %12s %16s %12s\n", "lock", "acquired", "contended", "spin cycles", "max hold" );
+    for( auto st = __atomic_load_n( &lock_stats_list, __ATOMIC_ACQUIRE ); st; st = st->next_lock )
+        printk( "[LOCKSTAT] %-16s %12llu %12llu %16llu %12llu\n", st->name ? st->name : "(anon)",
+                st->acquisitions, st->contended, st->spin_cycles, st->max_hold );
+#else
+    printk( "[LOCKSTAT] lock statistics not compiled in (build with LOCKSTAT=1)\n" );
+#endif
+}
@@ -39,6 +39,42 @@ memcpy( void * dest, const void * src, size_t n ) {
         return dest;
     }
 
+typedef u8 v16u8 __attribute__((vector_size(16)));
+
+// The kernel is built without vector registers (see the Makefile), this
+// one function opts in. It runs on the current task's SSE state, which
+// its first use sets up through #NM (arch.fpu).
+[[gnu::target("sse2")]] static void
+copy_sse2( u8 *dst, const u8 *src, size_t n ) {
+    v16u8 a, b, c, d;
+
+    // Byte-wise copies of the vectors become unaligned 16 byte moves
+    for( ; n >= 64; n -= 64, dst += 64, src += 64 ) {
+        __builtin_memcpy( &a, src, 16 );
+        __builtin_memcpy( &b, src + 16, 16 );
+        __builtin_memcpy( &c, src + 32, 16 );
+        __builtin_memcpy( &d, src + 48, 16 );
+        __builtin_memcpy( dst, &a, 16 );
+        __builtin_memcpy( dst + 16, &b, 16 );
+        __builtin_memcpy( dst + 32, &c, 16 );
+        __builtin_memcpy( dst + 48, &d, 16 );
+    }
+
+    while( n-- )
+        *dst++ = *src++;
+}
+
+/*
+ * memcpy() with 16 byte SSE2 moves, for large copies in task context only:
+ * interrupt handlers, the scheduler and the allocators would clobber the
+ * interrupted task's vector registers and must use memcpy().
+ */
+export void *
+memcpy_simd( void *dest, const void *src, size_t n ) {
+    copy_sse2( static_cast<u8 *>(dest), static_cast<const u8 *>(src), n );
+    return dest;
+}
+
 export u64 
 strlen( char *str )
 {
@@ -69,3 +105,19 @@ strcmp( char *s1, char *s2 )
 
     return 0;
 }
+
+export char *
+strstr( char *haystack, char *needle )
+{
+    u64 len = strlen( needle );
+
+    for( ; *haystack; haystack++ ) {
+        u64 i = 0;
+        while( i < len && haystack[i] == needle[i] )
+            i++;
+        if( i == len )
+            return haystack;
+    }
+
+    return len ? nullptr : haystack;
+}
@@ -0,0 +1,161 @@
+export module lib.trace;
+
+import types;
+import arch.cpu;
+import arch.io;
+
+// Binary event tracing. A tracepoint stores a fixed-size record (TSC,
+// CPU, event id, three u64 arguments) in this CPU's ring, which wraps and
+// keeps the latest TRACE_EVENTS events. Compiled in with `make TRACE=1`,
+// recording starts with "trace" on the kernel command line. dump() writes
+// the rings to COM1 for utilities/trace2json.rb.
+//
+// Below the `lib.print` layer on purpose, so panic() can dump the rings
+// and every subsystem can have tracepoints.
+constexpr u64 TRACE_EVENTS = 1024;     // per CPU, power of two
+
+export namespace trace {
+    // Keep in sync with EVENTS in utilities/trace2json.rb
+    enum event_t : u32 {
+        EV_SWITCH     = 1,      // prev pid, next pid, prev state
+        EV_IRQ_ENTRY  = 2,      // vector, rip
+        EV_IRQ_EXIT   = 3,      // vector
+        EV_KMALLOC    = 4,      // size, ptr
+        EV_KFREE      = 5,      // ptr
+        EV_PAGE_ALLOC = 6,      // phys, pages
+        EV_PAGE_FREE  = 7,      // phys, pages
+        EV_MAP_PAGE   = 8,      // virt, phys, flags
+    };
+
+    struct record_t {
+        u64 tsc;
+        u32 cpu;
+        u32 event;
+        u64 args[3];
+    };
+
+    struct alignas(64) buffer_t {
+        u64      next;          // total events recorded on this CPU
+        record_t records[TRACE_EVENTS];
+    };
+}
+
+// Not static: emit() is expanded in importers
+bool trace_enabled = false;
+u64  trace_tsc_hz;
+
+#ifdef KTRACE
+trace::buffer_t trace_buffers[MAX_CPU];
+
+static void
+put_str( const char *s ) {
+    while( *s )
+        arch::write_serial( *s++ );
+}
+
+static void
+put_hex( u64 value ) {
+    char buf[17];
+    int  i = 16;
+
+    buf[i] = 0;
+    do {
+        buf[--i] = "0123456789abcdef"[value & 0xF];
+        value >>= 4;
+    } while( value );
+
+    put_str( buf + i );
+}
+#endif
+
+export namespace trace {
+    /*
+     * Record an event. Interrupts stay off from the rdtscp, which yields
+     * both the timestamp and the CPU, until the record is written: a task
+     * can neither migrate to another ring nor be interrupted by another
+     * tracepoint on this one, so the slot needs no atomic claim.
+     */
+    inline void
+    emit( [[maybe_unused]] event_t event, [[maybe_unused]] u64 a0 = 0,
+          [[maybe_unused]] u64 a1 = 0, [[maybe_unused]] u64 a2 = 0 ) {
+#ifdef KTRACE
+        if( !__builtin_expect( trace_enabled, false ) )
+            return;
+
+        auto flags = arch::irq_save();
+
+        u32 lo, hi, cpu;
+        __asm__ volatile( "rdtscp" : "=a"(lo), "=d"(hi), "=c"(cpu) );
+
+        auto buf     = &trace_buffers[cpu];
+        auto rec     = &buf->records[buf->next++ & (TRACE_EVENTS - 1)];
+        rec->tsc     = ((u64)hi << 32) | lo;
+        rec->cpu     = cpu;
+        rec->event   = event;
+        rec->args[0] = a0;
+        rec->args[1] = a1;
+        rec->args[2] = a2;
+
+        arch::irq_restore( flags );
+#endif
+    }
+
+    // Start recording; `tsc_hz` goes into the dump for the decoder
+    void
+    start( u64 tsc_hz ) {
+        trace_tsc_hz = tsc_hz;
+#ifdef KTRACE
+        __atomic_store_n( &trace_enabled, true, __ATOMIC_RELEASE );
+#endif
+    }
+
+    void
+    stop() {
+        __atomic_store_n( &trace_enabled, false, __ATOMIC_RELEASE );
+    }
+
+    inline bool
+    active() {
+        return trace_enabled;
+    }
+
+    /*
+     * Stop recording and write every ring to COM1 by polling, oldest event
+     * first, one "@T cpu tsc event a0 a1 a2" line (hex) per record between
+     * "@TRACE begin" and "@TRACE end". Meant for panic() or a quiet console.
+     */
+    void
+    dump() {
+#ifdef KTRACE
+        stop();
+
+        put_str( "\n@TRACE begin tsc_hz=" );
+        put_hex( trace_tsc_hz );
+        put_str( "\n" );
+
+        for( u32 cpu = 0; cpu < MAX_CPU; cpu++ ) {
+            auto buf   = &trace_buffers[cpu];
+            u64  end   = buf->next;
+            u64  start = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+
+            for( u64 i = start; i < end; i++ ) {
+                auto rec = &buf->records[i & (TRACE_EVENTS - 1)];
+
+                put_str( "@T " );
+                put_hex( rec->cpu );
+                put_str( " " );
+                put_hex( rec->tsc );
+                put_str( " " );
+                put_hex( rec->event );
+                for( auto arg : rec->args ) {
+                    put_str( " " );
+                    put_hex( arg );
+                }
+                put_str( "\n" );
+            }
+        }
+
+        put_str( "@TRACE end\n" );
+#endif
+    }
+}
@@ -3,11 +3,17 @@ import arch.io;
 import arch.cpu;
 import arch.gdt;
 import arch.idt;
+import arch.fpu;
 import arch.simpleboot;
 import arch.lapic;
+import arch.time;
+import arch.smp;
 import arch.ps2;
+import arch.uart;
 import lib.print;
 import lib.string;
+import lib.spinlock;
+import lib.trace;
 import mm.pframe;
 import mm.heap;
 import sched;
@@ -15,6 +21,12 @@ import sched;
 u64 dbg_start = 0;
 u64 dbg_end   = 0;
 
+u32 nr_cores  = 1;
+u32 bsp_id    = 0;
+
+// "trace" on the command line: record events from init_time() on
+bool trace_boot = false;
+
 void
 task1() {
   printk("[TASK1] Task1 started!\n");
@@ -38,6 +50,19 @@ u8 stack2[4096];
 
 sched::task_t init_task;
 
+// Is `opt` one of the space separated words of `cmdline`?
+static bool
+cmdline_option( char *cmdline, char *opt ) {
+    u64 len = strlen( opt );
+
+    for( char *p = cmdline; (p = strstr( p, opt )); p++ ) {
+        if( (p == cmdline || p[-1] == ' ') && (p[len] == ' ' || !p[len]) )
+            return true;
+    }
+
+    return false;
+}
+
 extern "C" void
 KernelMain( u32 magic, u64 addr ) {
     if( arch::get_id() != 0 ) {
@@ -45,6 +70,8 @@ KernelMain( u32 magic, u64 addr ) {
         arch::halt_cpu();
     }
 
+    arch::set_this_cpu( arch::get_id() );
+
     printk( "Kernel started with magic: 0x%0x, addr: 0x%0llx\n", magic, addr );
     
     multiboot_tag *tag, *last;
@@ -56,6 +83,7 @@ KernelMain( u32 magic, u64 addr ) {
 
     arch::init_gdt(); 
     arch::init_idt(); 
+    arch::init_fpu();
     
     auto size = ((multiboot_info *)addr)->total_size;
     printk( "Announced MBI size 0x%x\n", size );
@@ -68,6 +96,10 @@ KernelMain( u32 magic, u64 addr ) {
         case MULTIBOOT_TAG_TYPE_CMDLINE:
           printk ("Command line = %s\n",
                   ((multiboot_tag_cmdline *) tag)->string);
+          if( cmdline_option( ((multiboot_tag_cmdline *) tag)->string, "lockstat" ) )
+            lockstat = true;
+          if( cmdline_option( ((multiboot_tag_cmdline *) tag)->string, "trace" ) )
+            trace_boot = true;
           break;
         case MULTIBOOT_TAG_TYPE_BOOT_LOADER_NAME:
           printk ("Boot loader name = %s\n",
@@ -175,6 +207,8 @@ KernelMain( u32 magic, u64 addr ) {
           printk (" %d core(s)\n", ((multiboot_tag_smp*) tag)->num_cores);
           printk (" %d running\n", ((multiboot_tag_smp*) tag)->running_cores);
           printk (" %02x bsp id\n", ((multiboot_tag_smp*) tag)->bspid);
+          nr_cores = ((multiboot_tag_smp*) tag)->num_cores;
+          bsp_id   = ((multiboot_tag_smp*) tag)->bspid;
           break;
         case MULTIBOOT_TAG_TYPE_PARTUUID:
           printk ("Partition UUIDs\n");
@@ -189,7 +223,11 @@ KernelMain( u32 magic, u64 addr ) {
 
     }
 
+    arch::init_time();
+    if( trace_boot )
+      trace::start( arch::tsc_frequency() );
     arch::init_lapic();
+    arch::init_uart();
 
     sched::init_kernel_task( &init_task );
     sched::set_current_task( &init_task );
@@ -201,6 +239,7 @@ KernelMain( u32 magic, u64 addr ) {
     sched::create_task( (void *)&task2, stack2, 4096 );
 
     sched::start_scheduler();
+    arch::start_aps( nr_cores, bsp_id );
     arch::enable_interrupts();
 
     auto a1 = mm::kmalloc( 16 );
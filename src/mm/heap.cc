@@ -4,195 +4,287 @@ import types;
 import arch.io;
 import arch.cpu;
 import lib.print;
+import lib.log;
 import lib.spinlock;
+import lib.trace;
 import mm.pframe;
+import mm.slab;
 
-constexpr auto ROUND_NUM = 10;
+// Blocks are multiples of 16 bytes: a 16 byte header, the payload and an
+// 8 byte footer repeating the size (boundary tag). Free blocks keep their
+// free-list links in the payload.
+constexpr auto HEAP_ALIGN   = 16UL;
+constexpr auto BLOCK_FREE   = 1UL;
+constexpr auto BLOCK_SIZE   = ~(HEAP_ALIGN - 1);
+constexpr auto MIN_SHIFT    = 6;    // smallest bucket holds blocks >= 64 bytes
+constexpr auto NR_BUCKETS   = 26;
 
 typedef struct heap_header heap_header_t;
 struct heap_header {
-    ulong length;
-    heap_header_t *next;
-    heap_header_t *last;
-    bool          is_free;
+    ulong          size;        // block size | BLOCK_FREE
+    ulong          reserved;
 
-    heap_header_t *split( ulong size ) {
-        if( size < ROUND_NUM )
-            return nullptr;
-    
-        ulong split_length = this->length - size - sizeof(heap_header_t);
-        if( split_length < ROUND_NUM )
-            return nullptr;
+    // Only valid while the block is free
+    heap_header_t *next_free;
+    heap_header_t *prev_free;
+
+    ulong length() { return size & BLOCK_SIZE; }
+    bool  is_free() { return size & BLOCK_FREE; }
+
+    ulong *footer() {
+        return reinterpret_cast<ulong *>((u8 *)this + length() - sizeof(ulong));
+    }
 
-        auto header = reinterpret_cast<heap_header_t *>((u8 *)this + size + sizeof(heap_header_t) );
-        
-        this->next->last = header;
-        header->next     = this->next;
-        this->next       = header;
-        header->last     = this;
+    void set( ulong length, bool free ) {
+        size      = length | (free ? BLOCK_FREE : 0);
+        *footer() = size;
+    }
 
-        header->length  = split_length;
-        header->is_free = true;
-        this->length    = size;
+    heap_header_t *next() {
+        return reinterpret_cast<heap_header_t *>((u8 *)this + length());
+    }
 
-        if( this->last == this )
-            this->last = header;
+    heap_header_t *prev() {
+        ulong prev_size = *(reinterpret_cast<ulong *>(this) - 1) & BLOCK_SIZE;
+        return reinterpret_cast<heap_header_t *>((u8 *)this - prev_size);
+    }
 
-        return header;
+    void *payload() {
+        return reinterpret_cast<u8 *>(this) + 2 * sizeof(ulong);
     }
 };
 
-static heap_header_t *last_header;
+constexpr auto HEADER_SIZE  = 2 * sizeof(ulong);
+constexpr auto OVERHEAD     = HEADER_SIZE + sizeof(ulong);
+constexpr auto MIN_BLOCK    = (sizeof(heap_header_t) + sizeof(ulong) + HEAP_ALIGN - 1) & BLOCK_SIZE;
+
+static heap_header_t *buckets[NR_BUCKETS];
+static u32            bucket_map;
 static void *        heap_start;
 static void *        heap_end;
 static void *        heap_address;
-static spinlock_t    kmalloc_lock;
+static spinlock_t    kmalloc_lock{ "kmalloc" };
+
+// Bucket i holds free blocks of 2^(i + MIN_SHIFT) .. 2^(i + MIN_SHIFT + 1) - 1 bytes
+inline u32
+bucket_index( ulong size ) {
+    u32 idx = 63 - __builtin_clzll( size ) - MIN_SHIFT;
+    if( (i32)idx < 0 )
+        return 0;
+    return idx < NR_BUCKETS ? idx : NR_BUCKETS - 1;
+}
+
+static void
+bucket_insert( heap_header_t *hdr ) {
+    u32 idx = bucket_index( hdr->length() );
+
+    hdr->prev_free = nullptr;
+    hdr->next_free = buckets[idx];
+    if( buckets[idx] )
+        buckets[idx]->prev_free = hdr;
+    buckets[idx] = hdr;
+    bucket_map |= 1U << idx;
+}
+
+static void
+bucket_remove( heap_header_t *hdr ) {
+    u32 idx = bucket_index( hdr->length() );
+
+    if( hdr->prev_free )
+        hdr->prev_free->next_free = hdr->next_free;
+    else
+        buckets[idx] = hdr->next_free;
+    if( hdr->next_free )
+        hdr->next_free->prev_free = hdr->prev_free;
+
+    if( !buckets[idx] )
+        bucket_map &= ~(1U << idx);
+}
+
+/*
+ * Find a free block of at least `size` bytes. Every block in a bucket above
+ * the one `size` falls into is large enough, so only the request's own
+ * bucket has to be searched for a fit.
+ */
+static heap_header_t *
+find_block( ulong size ) {
+    u32 idx   = bucket_index( size );
+    u32 above = idx + 1 < NR_BUCKETS ? bucket_map & (~0U << (idx + 1)) : 0;
+
+    if( above )
+        return buckets[__builtin_ctz( above )];
+
+    for( auto hdr = buckets[idx]; hdr; hdr = hdr->next_free ) {
+        if( hdr->length() >= size )
+            return hdr;
+    }
+
+    return nullptr;
+}
 
 export namespace mm {
-    void combine_backward( heap_header_t *hdr );
+    heap_header_t *combine_backward( heap_header_t *hdr );
     void combine_forward( heap_header_t *hdr );
 
-    void 
+    /*
+     * Map more pages behind heap_end. The old end marker becomes the header
+     * of the new free block, which is merged with a free block before it.
+     */
+    void
     expand_heap( size_t size ) {
-        kmalloc_lock.lock();
+        spinlock_irq_guard guard( kmalloc_lock );
 
-        if( size % ROUND_NUM ) {
-            size -= (size % ROUND_NUM);
-            size += ROUND_NUM;
-        }
+        auto pages  = page_align_up( size + OVERHEAD ) / mm::PAGE_SIZE;
+        auto header = reinterpret_cast<heap_header_t *>((u8 *)heap_end - HEADER_SIZE);
 
-        auto pages = size / mm::PAGE_SIZE;
-        auto header = reinterpret_cast<heap_header_t *>(heap_end);
-    
         for( auto i = 0UL; i < pages; i++ ) {
             ulong page = mm::phys_alloc_page();
             mm::map_page( mm::get_current_page_dir(), page, reinterpret_cast<u64>(heap_end), mm::PT_PRESENT | mm::PT_RW );
             heap_end = reinterpret_cast<u8 *>(heap_end) + PAGE_SIZE;
         }
 
-        header->is_free     = true;
-        header->last        = last_header;
-        last_header->next   = header;
-        last_header         = header;
-        header->next        = nullptr;
-        header->length      = size - sizeof(heap_header_t);
+        header->set( pages * PAGE_SIZE, true );
 
-        combine_backward( header );
+        // New end marker: an allocated zero-length block
+        auto end = reinterpret_cast<heap_header_t *>((u8 *)heap_end - HEADER_SIZE);
+        end->size = 0;
 
-        kmalloc_lock.release();
+        bucket_insert( combine_backward( header ) );
     }
 
     void *
     kmalloc( size_t size ) {
-        void *ret = nullptr;
-
         if( !size )
             return nullptr;
 
-        kmalloc_lock.lock();
-
-        if( size % ROUND_NUM ) {
-            size -= (size % ROUND_NUM);
-            size += ROUND_NUM;
+        // Small objects come from the power-of-two slab caches
+        if( size <= mm::KMALLOC_MAX_SMALL ) {
+            auto obj = mm::kmem_cache_alloc( mm::kmalloc_cache( size ) );
+            trace::emit( trace::EV_KMALLOC, size, (u64)obj );
+            return obj;
         }
 
-        auto hdr = reinterpret_cast<heap_header_t *>(heap_start);
-        while( true ) {
-            if( hdr->is_free ) {
-                if( hdr->length > size ) {
-                    hdr->split( size );
-                    hdr->is_free = false;
-                    
-                    ret = reinterpret_cast<void *>(hdr + sizeof(heap_header_t));
-                    printk( "hdr at 0x%x\n", hdr );
-                    goto finish;
-                }   
-                if( hdr->length == size ) {
-                    hdr->is_free = false;
-
-                    ret = reinterpret_cast<void *>(hdr + sizeof(heap_header_t));
-                    goto finish; 
-                }
-            }
+        ulong needed = (size + OVERHEAD + HEAP_ALIGN - 1) & BLOCK_SIZE;
+
+        auto flags = kmalloc_lock.lock_irqsave();
 
-            hdr = hdr->next;
+        auto hdr = find_block( needed );
+        if( !hdr ) {
+            kmalloc_lock.release_irqrestore( flags );
+            expand_heap( needed );
+            return kmalloc( size );
         }
 
-        kmalloc_lock.release();
-        expand_heap( size );
-        return kmalloc( size );
+        bucket_remove( hdr );
 
-    finish:
-        kmalloc_lock.release();
-        return ret;
+        // Split off the tail if it can hold a block of its own
+        ulong rest = hdr->length() - needed;
+        if( rest >= MIN_BLOCK ) {
+            hdr->set( needed, false );
+            hdr->next()->set( rest, true );
+            bucket_insert( hdr->next() );
+        } else {
+            hdr->set( hdr->length(), false );
+        }
+
+        kmalloc_lock.release_irqrestore( flags );
+        trace::emit( trace::EV_KMALLOC, size, (u64)hdr->payload() );
+        return hdr->payload();
     }
 
     void
     kfree( void *ptr ) {
-        auto header = reinterpret_cast<heap_header_t *>(ptr) - 1;
+        if( !ptr )
+            return;
 
-        kmalloc_lock.lock();
+        trace::emit( trace::EV_KFREE, (u64)ptr );
 
-        header->is_free = true;
-        combine_forward( header );
-        combine_backward( header );
+        if( ptr < heap_start || ptr >= heap_end ) {
+            if( !mm::is_slab_object( ptr ) ) {
+                klog::error<klog::heap>( "kfree of unknown pointer 0x%lX\n", ptr );
+                return;
+            }
+
+            mm::kmem_cache_free( mm::slab_of( ptr )->cache, ptr );
+            return;
+        }
+
+        auto header = reinterpret_cast<heap_header_t *>((u8 *)ptr - HEADER_SIZE);
+
+        spinlock_irq_guard guard( kmalloc_lock );
+
+        if( header->is_free() ) {
+            klog::error<klog::heap>( "double free of 0x%lX\n", ptr );
+            return;
+        }
 
-        kmalloc_lock.release();
+        header->set( header->length(), true );
+        combine_forward( header );
+        bucket_insert( combine_backward( header ) );
     }
 
+    // Absorb the following block if it is free. O(1) via its header.
     void
     combine_forward( heap_header_t *hdr ) {
-        if( (hdr->next == nullptr) || !hdr->next->is_free )
-            return;
-
-        if( hdr->next == last_header )
-            last_header = hdr;
+        auto next = hdr->next();
 
-        hdr->next = hdr->next->next;
-        hdr->length = hdr->length + hdr->next->length + sizeof(heap_header_t);
+        if( !next->is_free() )
+            return;
 
-        printk( "Combined forwards.\n" );
+        bucket_remove( next );
+        hdr->set( hdr->length() + next->length(), true );
     }
 
-    void
+    // Merge into the preceding block if it is free, found via its footer.
+    // Returns the header of the merged block.
+    heap_header_t *
     combine_backward( heap_header_t *hdr ) {
-        if( hdr->last != nullptr && hdr->last->is_free )
-            combine_forward( hdr->last );
+        if( !(*(reinterpret_cast<ulong *>(hdr) - 1) & BLOCK_FREE) )
+            return hdr;
 
-        printk( "Combined backwards.\n" );
+        auto prev = hdr->prev();
+
+        bucket_remove( prev );
+        prev->set( prev->length() + hdr->length(), true );
+        return prev;
     }
 
     void
     init_kmalloc( ulong pages = 10 ) {
-        printk( "Initializing heap\n" );
+        klog::debug<klog::heap>( "Initializing heap\n" );
+
+        mm::init_slab();
 
         auto nu = mm::heap_request_page();
-        printk( "[HEAP] starting at 0x%x\n", nu );
+        klog::info<klog::heap>( "starting at 0x%x\n", nu );
 
-        if( nu == nullptr ) 
-            panic( "Couldn't allocate page." );        
+        if( nu == nullptr )
+            panic( "Couldn't allocate page." );
 
-        void *iter = nu;
-        for( ulong i = 0; i < pages - i; i++ ) {
+        void *iter = (u8 *)nu + PAGE_SIZE;
+        for( ulong i = 1; i < pages; i++ ) {
             auto frame = mm::phys_alloc_page( true );
             mm::map_page( mm::get_current_page_dir(), reinterpret_cast<ulong>(frame), reinterpret_cast<ulong>(iter), mm::PT_PRESENT | mm::PT_RW );
             iter = (u8 *)iter + PAGE_SIZE;
         }
 
-        
-
         heap_address = nu;
         ulong length = pages * PAGE_SIZE;
 
         heap_start  = heap_address;
         heap_end    = (void *)((u8 *)heap_start + length);
 
-        heap_header_t *start_header = reinterpret_cast<heap_header_t *>(heap_address);
-        start_header->length        = length - sizeof(heap_header_t);
-        start_header->next          = nullptr;
-        start_header->last          = nullptr;
-        start_header->is_free       = true;
+        // Start marker: an allocated footer so the first block never merges
+        // backwards. End marker: an allocated zero-length header.
+        auto start = reinterpret_cast<ulong *>(heap_start);
+        start[1]   = 0;
+
+        auto first = reinterpret_cast<heap_header_t *>((u8 *)heap_start + HEADER_SIZE);
+        first->set( length - 2 * HEADER_SIZE, true );
+
+        auto end  = reinterpret_cast<heap_header_t *>((u8 *)heap_end - HEADER_SIZE);
+        end->size = 0;
 
-        last_header = start_header;
+        bucket_insert( first );
     }
-}
\ No newline at end of file
+}
@@ -5,13 +5,57 @@ import arch.io;
 import arch.simpleboot;
 import arch.cpu;
 import lib.print;
+import lib.log;
 import lib.string;
+import lib.spinlock;
+import lib.trace;
 
 constexpr auto HEAP_BASE = 0xFFFFFFFFF0002000UL;
 
+// Buddy allocator: free blocks of 2^order frames, orders 0 .. MAX_ORDER-1
+// (4 KiB up to 4 MiB). The bitmap keeps one bit per frame (1 = in use) and
+// stays the authoritative view of which frames are taken.
+constexpr auto MAX_ORDER  = 11;
+constexpr auto FRAME_SIZE = 4096;
+
+// Node stored inside every free block (physical memory is identity mapped).
+struct free_block {
+    free_block *next;
+    free_block *prev;
+};
+
+struct free_area {
+    free_block *head;
+    size_t      count;
+};
+
 u8    *bitmap;
 size_t bitmap_size;
 size_t total_memory;
+size_t total_frames;
+
+// order + 1 for frames heading a free block, 0 otherwise
+u8        *block_order;
+free_area  free_areas[MAX_ORDER];
+
+// Per-CPU stack of free frames in front of the buddy allocator. It is
+// refilled and drained in batches, so single-frame allocations only take
+// pframe_lock once every PCP_BATCH calls.
+constexpr auto PCP_SIZE   = 64;
+constexpr auto PCP_BATCH  = 16;
+constexpr auto PCP_ORDER  = 4;  // log2(PCP_BATCH)
+
+struct alignas(64) frame_cache {
+    size_t count;
+    size_t frames[PCP_SIZE];
+};
+
+frame_cache frame_caches[MAX_CPU];
+spinlock_t  pframe_lock{ "pframe" };
+
+// Every frame below the hint is in use. Frees lower it, the run scanner
+// advances it past what it found allocated.
+size_t     free_hint;
 
 inline void
 set_page( size_t page ) {
@@ -23,6 +67,289 @@ clear_page( size_t page ) {
     bitmap[page / 8] &= ~(1 << (page % 8));
 }
 
+inline bool
+test_page( size_t page ) {
+    return bitmap[page / 8] & (1 << (page % 8));
+}
+
+// Apply `set` to `count` bits from `page` on, whole u64 words at a time.
+void
+update_range( size_t page, size_t count, bool set ) {
+    auto  *words = reinterpret_cast<u64 *>(bitmap);
+    size_t end   = page + count;
+
+    while( page < end ) {
+        size_t bit  = page % 64;
+        size_t bits = end - page < 64 - bit ? end - page : 64 - bit;
+        u64    mask = bits == 64 ? ~0UL : ((1UL << bits) - 1) << bit;
+
+        if( set )
+            words[page / 64] |= mask;
+        else
+            words[page / 64] &= ~mask;
+
+        page += bits;
+    }
+}
+
+inline void
+set_range( size_t page, size_t count ) {
+    if( count == 1 )
+        set_page( page );
+    else
+        update_range( page, count, true );
+}
+
+inline void
+clear_range( size_t page, size_t count ) {
+    if( count == 1 )
+        clear_page( page );
+    else
+        update_range( page, count, false );
+}
+
+inline free_block *
+pfn_to_block( size_t pfn ) {
+    return reinterpret_cast<free_block *>(pfn * FRAME_SIZE);
+}
+
+inline size_t
+block_to_pfn( free_block *block ) {
+    return reinterpret_cast<size_t>(block) / FRAME_SIZE;
+}
+
+static void
+free_list_push( size_t pfn, u32 order ) {
+    auto *block = pfn_to_block( pfn );
+    auto &area  = free_areas[order];
+
+    block->prev = nullptr;
+    block->next = area.head;
+    if( area.head )
+        area.head->prev = block;
+    area.head = block;
+    area.count++;
+
+    block_order[pfn] = order + 1;
+}
+
+static void
+free_list_remove( size_t pfn, u32 order ) {
+    auto *block = pfn_to_block( pfn );
+    auto &area  = free_areas[order];
+
+    if( block->prev )
+        block->prev->next = block->next;
+    else
+        area.head = block->next;
+    if( block->next )
+        block->next->prev = block->prev;
+    area.count--;
+
+    block_order[pfn] = 0;
+}
+
+/*
+ * Take a block of 2^order frames off the free lists, splitting a larger
+ * block if needed. Returns the first frame number or -1 when no block of
+ * sufficient order is free.
+ */
+static size_t
+buddy_alloc( u32 order ) {
+    u32 o = order;
+
+    while( o < MAX_ORDER && !free_areas[o].head )
+        o++;
+
+    if( o == MAX_ORDER )
+        return -1;
+
+    size_t pfn = block_to_pfn( free_areas[o].head );
+    free_list_remove( pfn, o );
+
+    // Hand the upper halves back until the block has the requested size
+    while( o > order ) {
+        o--;
+        free_list_push( pfn + (1UL << o), o );
+    }
+
+    set_range( pfn, 1UL << order );
+    return pfn;
+}
+
+/*
+ * Return a block of 2^order frames and merge it with its buddies as long
+ * as they are free and of the same order.
+ */
+static void
+buddy_free( size_t pfn, u32 order ) {
+    clear_range( pfn, 1UL << order );
+
+    if( pfn < free_hint )
+        free_hint = pfn;
+
+    while( order < MAX_ORDER - 1 ) {
+        size_t buddy = pfn ^ (1UL << order);
+
+        if( buddy + (1UL << order) > total_frames || block_order[buddy] != order + 1 )
+            break;
+
+        free_list_remove( buddy, order );
+        pfn &= ~(1UL << order);
+        order++;
+    }
+
+    free_list_push( pfn, order );
+}
+
+/*
+ * Give the frames [pfn, end) back as the largest naturally aligned blocks
+ * that fit.
+ */
+static void
+release_range( size_t pfn, size_t end ) {
+    while( pfn < end ) {
+        u32 order = 0;
+        while( order < MAX_ORDER - 1 &&
+               !(pfn & ((2UL << order) - 1)) &&
+               pfn + (2UL << order) <= end )
+            order++;
+
+        buddy_free( pfn, order );
+        pfn += 1UL << order;
+    }
+}
+
+inline u64 *
+bitmap_words() {
+    return reinterpret_cast<u64 *>(bitmap);
+}
+
+// First frame >= pfn whose bit equals `used`, or total_frames if none.
+static size_t
+find_next( size_t pfn, bool used ) {
+    auto  *words = bitmap_words();
+    size_t nwords = bitmap_size / sizeof(u64);
+    size_t i      = pfn / 64;
+
+    if( i >= nwords )
+        return total_frames;
+
+    u64 w = used ? words[i] : ~words[i];
+    w &= ~0UL << (pfn % 64);
+
+    while( !w ) {
+        if( ++i == nwords )
+            return total_frames;
+        w = used ? words[i] : ~words[i];
+    }
+
+    size_t found = i * 64 + __builtin_ctzll( w );
+    return found < total_frames ? found : total_frames;
+}
+
+/*
+ * Find `count` free frames in a row starting at a multiple of `align`
+ * frames, scanning the bitmap a 64-bit word at a time.
+ */
+static size_t
+find_free_run( size_t count, size_t align ) {
+    size_t pfn = find_next( free_hint, false );
+
+    free_hint = pfn;
+
+    while( pfn + count <= total_frames ) {
+        pfn = find_next( pfn, false );
+        pfn = (pfn + align - 1) & ~(align - 1);
+
+        if( pfn + count > total_frames )
+            break;
+
+        size_t used = find_next( pfn, true );
+        if( used >= pfn + count ) {
+            if( pfn == free_hint )
+                free_hint = pfn + count;
+            return pfn;
+        }
+
+        pfn = used + 1;
+    }
+
+    return -1;
+}
+
+// Move PCP_BATCH frames from the buddy lists into the cache. Interrupts are
+// already off here.
+static void
+frame_cache_refill( frame_cache *fc ) {
+    pframe_lock.lock();
+
+    size_t pfn = buddy_alloc( PCP_ORDER );
+    if( pfn != (size_t)-1 ) {
+        // Frames of the split block are freed one by one later, which the
+        // buddy allocator handles since every frame has its own bit.
+        for( size_t i = 0; i < PCP_BATCH; i++ )
+            fc->frames[fc->count++] = pfn + i;
+    } else {
+        while( fc->count < PCP_BATCH && (pfn = buddy_alloc( 0 )) != (size_t)-1 )
+            fc->frames[fc->count++] = pfn;
+    }
+
+    pframe_lock.release();
+}
+
+// Return the oldest `count` cached frames to the buddy lists.
+static void
+frame_cache_drain( frame_cache *fc, size_t count ) {
+    pframe_lock.lock();
+
+    for( size_t i = 0; i < count; i++ )
+        buddy_free( fc->frames[i], 0 );
+
+    pframe_lock.release();
+
+    fc->count -= count;
+    for( size_t i = 0; i < fc->count; i++ )
+        fc->frames[i] = fc->frames[i + count];
+}
+
+/*
+ * Pull the frames [pfn, pfn + count) out of the buddy free lists. Every
+ * frame in the range must be free; the parts of the affected blocks that
+ * lie outside the range are handed back.
+ */
+static void
+carve_range( size_t pfn, size_t count ) {
+    size_t end = pfn + count;
+
+    set_range( pfn, count );
+
+    for( size_t cur = pfn; cur < end; ) {
+        u32    order = 0;
+        size_t head  = cur;
+
+        while( order < MAX_ORDER ) {
+            head = cur & ~((1UL << order) - 1);
+            if( block_order[head] == order + 1 )
+                break;
+            order++;
+        }
+
+        if( order == MAX_ORDER )
+            panic( "carve_range: frame not on a free list.\n" );
+
+        size_t block_end = head + (1UL << order);
+        free_list_remove( head, order );
+
+        if( head < pfn )
+            release_range( head, pfn );
+        if( block_end > end )
+            release_range( end, block_end );
+
+        cur = block_end;
+    }
+}
+
 static ulong heap_base = HEAP_BASE;
 
 export namespace mm {
@@ -115,55 +442,189 @@ export namespace mm {
 
         heap_base = HEAP_BASE;
 
-        printk( "[HeapRequest] mapping 0x%lX to 0x%lX\n", page, heap_base );
+        klog::debug<klog::physmm>( "heap_request_page: mapping 0x%lX to 0x%lX\n", page, heap_base );
 
         map_page( mm::get_current_page_dir(), page, heap_base, PT_PRESENT | PT_RW );
         heap_base += PAGE_SIZE;
 
-        printk( "[HeapRequest] 0x%x\n", ret );
+        klog::debug<klog::physmm>( "heap_request_page: 0x%x\n", ret );
         return (void *)ret;
     }
 
-    inline void
+    /*
+     * Allocate a naturally aligned run of 2^order frames.
+     */
+    physaddr_t
+    phys_alloc_order( u32 order, bool zeroed = true ) {
+        if( order >= MAX_ORDER )
+            panic( "phys_alloc_order: order too large.\n" );
+
+        auto   flags = pframe_lock.lock_irqsave();
+        size_t pfn   = buddy_alloc( order );
+        pframe_lock.release_irqrestore( flags );
+
+        if( pfn == (size_t)-1 )
+            panic( "Out of memory!" );
+
+        physaddr_t pg = pfn * PAGE_SIZE;
+
+        if( zeroed )
+            memset( (void *)(pg), 0, PAGE_SIZE << order );
+
+        trace::emit( trace::EV_PAGE_ALLOC, pg, 1UL << order );
+        return pg;
+    }
+
+    void
+    phys_free_order( physaddr_t base, u32 order ) {
+        size_t pfn = base / PAGE_SIZE;
+
+        if( pfn + (1UL << order) > total_frames || !test_page( pfn ) ) {
+            klog::error<klog::physmm>( "bogus free of 0x%lX (order %d)\n", base, order );
+            return;
+        }
+
+        trace::emit( trace::EV_PAGE_FREE, base, 1UL << order );
+
+        spinlock_irq_guard guard( pframe_lock );
+        buddy_free( pfn, order );
+    }
+
+    void
     phys_free_page( size_t base ) {
-        clear_page( base / PAGE_SIZE );
+        size_t pfn = base / PAGE_SIZE;
+
+        if( pfn >= total_frames || !test_page( pfn ) ) {
+            klog::error<klog::physmm>( "bogus free of 0x%lX\n", base );
+            return;
+        }
+
+        trace::emit( trace::EV_PAGE_FREE, base, 1 );
+
+        auto  flags = arch::irq_save();
+        auto *fc    = &frame_caches[arch::this_cpu()];
+
+        if( fc->count == PCP_SIZE )
+            frame_cache_drain( fc, PCP_BATCH );
+        fc->frames[fc->count++] = pfn;
+
+        arch::irq_restore( flags );
     }
 
-    inline void
+    // Give this CPU's cached frames back to the buddy lists.
+    void
+    phys_drain_cache() {
+        auto flags = arch::irq_save();
+        auto *fc   = &frame_caches[arch::this_cpu()];
+
+        frame_cache_drain( fc, fc->count );
+        arch::irq_restore( flags );
+    }
+
+    void
     phys_free_range( size_t base, size_t size ) {
-        for( size_t i = 0; i < size; i++ )
-            phys_free_page( base + i * PAGE_SIZE );
+        size_t pfn = page_align_up( base ) / PAGE_SIZE;
+        size_t end = page_align_down( base + size ) / PAGE_SIZE;
+
+        if( end > total_frames )
+            end = total_frames;
 
-        printk( "cleared range from 0x%x to 0x%x\n", base, size );
+        auto flags = pframe_lock.lock_irqsave();
+        release_range( pfn, end );
+        pframe_lock.release_irqrestore( flags );
+
+        klog::debug<klog::physmm>( "cleared range from 0x%x to 0x%x\n", base, base + size );
     }
 
+    /*
+     * Allocate `count` physically contiguous frames whose base is aligned to
+     * `align` bytes (a power of two, at least PAGE_SIZE). Small requests are
+     * served by the buddy lists, anything else by a word-wise bitmap scan.
+     * Returns -1 if no such run is free.
+     */
     physaddr_t
-    phys_alloc_page( bool zeroed ) {
-        auto      *p     = bitmap;
-        auto      *p_end = bitmap + bitmap_size;
-        physaddr_t pg    = -1;
+    phys_alloc_pages( size_t count, size_t align = PAGE_SIZE, bool zeroed = true ) {
+        if( !count || (align & (align - 1)) )
+            return -1;
 
-        while( p < p_end && *p == 0xFF )
-            p++;
+        size_t align_pages = align > PAGE_SIZE ? align / PAGE_SIZE : 1;
+        size_t span        = count > align_pages ? count : align_pages;
+        u32    order       = 0;
+        size_t pfn         = -1;
 
-        if( p == p_end )
-            panic( "Out of memory!" ); 
+        while( (1UL << order) < span )
+            order++;
 
-        for( auto i = 0; i < 8; i++ ) {
-            if( !(*p & (1 << i)) ) {
-                pg = (size_t)(((p - bitmap) * 8 + i)* PAGE_SIZE );
-                break;
+        for( auto attempt = 0; attempt < 2 && pfn == (size_t)-1; attempt++ ) {
+            // Frames parked in this CPU's cache may be what splits a run
+            if( attempt )
+                phys_drain_cache();
+
+            spinlock_irq_guard guard( pframe_lock );
+
+            if( order < MAX_ORDER ) {
+                pfn = buddy_alloc( order );
+
+                // Trim the unused tail of the power-of-two block
+                if( pfn != (size_t)-1 && count < (1UL << order) )
+                    release_range( pfn + count, pfn + (1UL << order) );
+            }
+
+            // Too large for the buddy lists or they are fragmented
+            if( pfn == (size_t)-1 ) {
+                pfn = find_free_run( count, align_pages );
+                if( pfn != (size_t)-1 )
+                    carve_range( pfn, count );
             }
         }
 
-        if( pg == -1 )
-            panic( "Failed to allocate page.\n" );
+        if( pfn == (size_t)-1 )
+            return -1;
+
+        physaddr_t pg = pfn * PAGE_SIZE;
+
+        if( zeroed )
+            memset( (void *)(pg), 0, count * PAGE_SIZE );
+
+        trace::emit( trace::EV_PAGE_ALLOC, pg, count );
+        return pg;
+    }
+
+    void
+    phys_free_pages( physaddr_t base, size_t count ) {
+        size_t pfn = base / PAGE_SIZE;
+
+        if( pfn + count > total_frames || find_next( pfn, false ) < pfn + count ) {
+            klog::error<klog::physmm>( "bogus free of 0x%lX (%d pages)\n", base, count );
+            return;
+        }
+
+        trace::emit( trace::EV_PAGE_FREE, base, count );
+
+        spinlock_irq_guard guard( pframe_lock );
+        release_range( pfn, pfn + count );
+    }
+
+    physaddr_t
+    phys_alloc_page( bool zeroed ) {
+        auto  flags = arch::irq_save();
+        auto *fc    = &frame_caches[arch::this_cpu()];
 
-        set_page( pg / PAGE_SIZE );
+        if( !fc->count )
+            frame_cache_refill( fc );
+
+        if( !fc->count ) {
+            arch::irq_restore( flags );
+            panic( "Out of memory!" );
+        }
+
+        physaddr_t pg = fc->frames[--fc->count] * PAGE_SIZE;
+        arch::irq_restore( flags );
 
         if( zeroed )
             memset( (void *)(pg), 0, PAGE_SIZE );
 
+        trace::emit( trace::EV_PAGE_ALLOC, pg, 1 );
         return pg;
     }
 
@@ -172,7 +633,7 @@ export namespace mm {
         multiboot_mmap_entry *biggest_part = nullptr;
         size_t available_memory = 0;
 
-        printk( "phys_init_multiboot: 0x%0x, count %d\n", (u64)mmap, count );
+        klog::debug<klog::physmm>( "phys_init_multiboot: 0x%0x, count %d\n", (u64)mmap, count );
 
         for( auto i = 0; i < count; i++ ) {
             if( mmap[i].type == MULTIBOOT_MEMORY_AVAILABLE ) {
@@ -183,24 +644,41 @@ export namespace mm {
             }
         }
 
-        printk( "Total available memory: %d MB\n", available_memory / 1024 / 1024 );
+        klog::info<klog::physmm>( "Total available memory: %d MB\n", available_memory / 1024 / 1024 );
+
+        for( auto i = 0; i < count; i++ ) {
+            if( mmap[i].type == MULTIBOOT_MEMORY_AVAILABLE && mmap[i].base_addr + mmap[i].length > total_memory )
+                total_memory = mmap[i].base_addr + mmap[i].length;
+        }
+
+        total_frames = total_memory / PAGE_SIZE;
+        bitmap_size  = ((total_frames + 63) / 64) * sizeof(u64);
 
         bitmap = (u8 *)biggest_part->base_addr + 0x100000; // hack for not crashing?? skip first MB. Guess easyboot places the kernel wrongly at 0x100000
-        bitmap_size = available_memory / PAGE_SIZE / 8;
-        biggest_part->base_addr += bitmap_size + 0x100000;
+        block_order = bitmap + bitmap_size;
+
+        size_t region_end = biggest_part->base_addr + biggest_part->length;
+        biggest_part->base_addr += bitmap_size + total_frames + 0x100000;
 
-        printk( "Physical memory bitmap at 0x%0x, size %d bytes\n", (u64)bitmap, bitmap_size );
+        klog::debug<klog::physmm>( "Physical memory bitmap at 0x%0x, size %d bytes\n", (u64)bitmap, bitmap_size );
         memset( bitmap, 0xFF, bitmap_size );
+        memset( block_order, 0, total_frames );
+        memset( free_areas, 0, sizeof(free_areas) );
+        free_hint = total_frames;
 
-        printk( "Kernel page table is at 0x%0x\n", (u64)get_current_page_dir() );
+        klog::debug<klog::physmm>( "Kernel page table is at 0x%0x\n", (u64)get_current_page_dir() );
 
         if( biggest_part-> base_addr < 0x200000 )
             biggest_part->base_addr = 0x200000;
+        biggest_part->length = region_end - biggest_part->base_addr;
         phys_free_range( biggest_part->base_addr, biggest_part->length );
 
+        for( auto o = 0; o < MAX_ORDER; o++ )
+            klog::debug<klog::physmm>( "order %d: %d free block(s)\n", o, free_areas[o].count );
+
         auto p1 = phys_alloc_page();
         auto p2 = phys_alloc_page();
-        printk( "[PhysMM] alloc1 = 0x%xl | alloc2 = 0x%xl\n", p1, p2 );
+        klog::debug<klog::physmm>( "alloc1 = 0x%xl | alloc2 = 0x%xl\n", p1, p2 );
     }
 
     /*
@@ -236,6 +714,8 @@ export namespace mm {
         p2_t *p1 = get_table( p2, indexer.p2_idx, flags );
 
         p1[indexer.p1_idx].entry = (phys_addr & PGADDR_MASK) | flags; // Clear the lower 12 bits
+
+        trace::emit( trace::EV_MAP_PAGE, virt_addr, phys_addr, flags );
     }
 
     void
@@ -273,19 +753,19 @@ export namespace mm {
         if( !dir[indexer.p4_idx].present )
             return -1;
 
-        printk( "virt_to_phys: %lX -> P4[%d] = %lX\n", virt_addr, indexer.p4_idx, dir[indexer.p4_idx].entry );
+        klog::trace<klog::physmm>( "virt_to_phys: %lX -> P4[%d] = %lX\n", virt_addr, indexer.p4_idx, dir[indexer.p4_idx].entry );
 
         p3_t *p3 = (p3_t *)(dir[indexer.p4_idx].entry & PGADDR_MASK);
         if( !p3[indexer.p3_idx].present )
             return -1;
 
-        printk( "virt_to_phys: %lX -> P3[%d] = %lX\n", virt_addr, indexer.p3_idx, p3[indexer.p3_idx].entry );
+        klog::trace<klog::physmm>( "virt_to_phys: %lX -> P3[%d] = %lX\n", virt_addr, indexer.p3_idx, p3[indexer.p3_idx].entry );
 
         p2_t *p2 = (p2_t *)(p3[indexer.p3_idx].entry & PGADDR_MASK);
         if( !p2[indexer.p2_idx].present )
             return -1;
 
-        printk( "virt_to_phys: %lX -> P2[%d] = %lX | huge = %s\n", virt_addr, indexer.p2_idx, p2[indexer.p2_idx].entry, p2[indexer.p2_idx].huge_page ? "true" : "false" );
+        klog::trace<klog::physmm>( "virt_to_phys: %lX -> P2[%d] = %lX | huge = %s\n", virt_addr, indexer.p2_idx, p2[indexer.p2_idx].entry, p2[indexer.p2_idx].huge_page ? "true" : "false" );
 
         if( p2[indexer.p2_idx].huge_page ) {
             // If it's a huge page, return the physical address directly
@@ -296,7 +776,7 @@ export namespace mm {
         if( !p1[indexer.p1_idx].present )
             return -1;
 
-        printk( "virt_to_phys: %lX -> P1[%d] = %lX\n", virt_addr, indexer.p1_idx, p1[indexer.p1_idx].entry );
+        klog::trace<klog::physmm>( "virt_to_phys: %lX -> P1[%d] = %lX\n", virt_addr, indexer.p1_idx, p1[indexer.p1_idx].entry );
 
         return p1[indexer.p1_idx].entry & PGADDR_MASK; // Clear the lower 12 bits
     }
@@ -0,0 +1,262 @@
+export module mm.slab;
+
+import types;
+import arch.cpu;
+import lib.print;
+import lib.log;
+import lib.spinlock;
+import mm.pframe;
+
+// Every slab is a naturally aligned block of 2^SLAB_ORDER frames with its
+// header at the start, so the owning slab of an object is found by masking
+// the object address.
+//
+// Slabs belong to one CPU. The owner allocates and frees on them with
+// interrupts disabled and no lock; other CPUs push freed objects onto the
+// owner's lock-free remote list, which the owner takes over in one atomic
+// exchange when it runs out of free objects.
+constexpr auto SLAB_ORDER   = 1;
+constexpr auto SLAB_SIZE    = 4096UL << SLAB_ORDER;
+constexpr auto SLAB_MAGIC   = 0x51AB51ABU;
+constexpr auto SLAB_ALIGN   = 16UL;
+constexpr auto MAX_CACHES   = 32;
+
+struct slab_object {
+    slab_object *next;
+};
+
+export namespace mm {
+    constexpr auto KMALLOC_MIN_SHIFT = 4;   // 16 bytes
+    constexpr auto KMALLOC_MAX_SHIFT = 11;  // 2048 bytes
+    constexpr auto KMALLOC_MAX_SMALL = 1UL << KMALLOC_MAX_SHIFT;
+
+    struct kmem_cache_t;
+
+    struct slab_t {
+        u32           magic;
+        u32           inuse;
+        kmem_cache_t *cache;
+        slab_t       *next;
+        slab_t       *prev;
+        slab_object  *free;
+        u32           cpu;          // owning CPU
+    };
+
+    struct alignas(64) cpu_slabs_t {
+        slab_t      *partial;       // slabs with at least one free object
+        slab_object *remote_free;   // objects freed by other CPUs
+        size_t       nr_slabs;
+    };
+
+    struct kmem_cache_t {
+        const char *name;
+        size_t      size;           // object size including alignment padding
+        size_t      offset;         // offset of the first object in a slab
+        size_t      objs_per_slab;
+        cpu_slabs_t cpu[MAX_CPU];
+    };
+
+    slab_t *
+    slab_of( void *ptr ) {
+        return reinterpret_cast<slab_t *>(reinterpret_cast<u64>(ptr) & ~(SLAB_SIZE - 1));
+    }
+}
+
+static mm::kmem_cache_t  caches[MAX_CACHES];
+static size_t            nr_caches;
+static spinlock_t        caches_lock{ "kmem_caches" };
+static mm::kmem_cache_t *kmalloc_caches[mm::KMALLOC_MAX_SHIFT - mm::KMALLOC_MIN_SHIFT + 1];
+
+static const char *kmalloc_names[] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+static void
+partial_push( mm::cpu_slabs_t *pc, mm::slab_t *slab ) {
+    slab->prev = nullptr;
+    slab->next = pc->partial;
+    if( pc->partial )
+        pc->partial->prev = slab;
+    pc->partial = slab;
+}
+
+static void
+partial_remove( mm::cpu_slabs_t *pc, mm::slab_t *slab ) {
+    if( slab->prev )
+        slab->prev->next = slab->next;
+    else
+        pc->partial = slab->next;
+    if( slab->next )
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = nullptr;
+}
+
+// Allocate a fresh slab for `cpu` and thread all of its objects onto the free list.
+static mm::slab_t *
+slab_grow( mm::kmem_cache_t *cache, u32 cpu ) {
+    auto slab = reinterpret_cast<mm::slab_t *>(mm::phys_alloc_order( SLAB_ORDER, false ));
+
+    slab->magic = SLAB_MAGIC;
+    slab->inuse = 0;
+    slab->cache = cache;
+    slab->free  = nullptr;
+    slab->cpu   = cpu;
+
+    auto base = reinterpret_cast<u8 *>(slab) + cache->offset;
+    for( size_t i = cache->objs_per_slab; i-- > 0; ) {
+        auto obj  = reinterpret_cast<slab_object *>(base + i * cache->size);
+        obj->next  = slab->free;
+        slab->free = obj;
+    }
+
+    cache->cpu[cpu].nr_slabs++;
+    partial_push( &cache->cpu[cpu], slab );
+    return slab;
+}
+
+// Return an object to a slab owned by the calling CPU. Interrupts must be off.
+static void
+slab_free_local( mm::cpu_slabs_t *pc, mm::slab_t *slab, slab_object *obj ) {
+    bool was_full = !slab->free;
+
+    obj->next  = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+
+    if( was_full )
+        partial_push( pc, slab );
+
+    // Give an empty slab back unless it is the only partial one, so a CPU
+    // allocating and freeing a single object does not churn pages. Other
+    // partial slabs may still be in use; empties are not kept for them.
+    if( !slab->inuse && (slab->next || slab->prev) ) {
+        partial_remove( pc, slab );
+        slab->magic = 0;
+        pc->nr_slabs--;
+        mm::phys_free_order( reinterpret_cast<physaddr_t>(slab), SLAB_ORDER );
+    }
+}
+
+// Take over everything other CPUs freed to us since the last drain.
+static void
+drain_remote( mm::cpu_slabs_t *pc ) {
+    auto obj = __atomic_exchange_n( &pc->remote_free, nullptr, __ATOMIC_ACQUIRE );
+
+    while( obj ) {
+        auto next = obj->next;
+        slab_free_local( pc, mm::slab_of( obj ), obj );
+        obj = next;
+    }
+}
+
+export namespace mm {
+    bool
+    is_slab_object( void *ptr ) {
+        return slab_of( ptr )->magic == SLAB_MAGIC;
+    }
+
+    /*
+     * Create a cache for objects of a fixed size and power-of-two alignment.
+     * Caches live in a static table and are never destroyed; claiming a
+     * slot is locked, as any CPU may create a cache.
+     */
+    kmem_cache_t *
+    kmem_cache_create( const char *name, size_t size, size_t align = SLAB_ALIGN ) {
+        if( size < sizeof(slab_object) )
+            size = sizeof(slab_object);
+        if( align < SLAB_ALIGN )
+            align = SLAB_ALIGN;
+        size = (size + align - 1) & ~(align - 1);
+
+        size_t slot;
+        {
+            spinlock_irq_guard guard( caches_lock );
+            slot = nr_caches < MAX_CACHES ? nr_caches++ : MAX_CACHES;
+        }
+
+        if( slot == MAX_CACHES ) {
+            klog::error<klog::slab>( "no free cache slot for %s\n", name );
+            return nullptr;
+        }
+
+        auto cache = &caches[slot];
+        cache->name          = name;
+        cache->size          = size;
+        cache->offset        = (sizeof(slab_t) + align - 1) & ~(align - 1);
+        cache->objs_per_slab = (SLAB_SIZE - cache->offset) / size;
+
+        if( !cache->objs_per_slab )
+            panic( "kmem_cache_create: object does not fit in a slab.\n" );
+
+        return cache;
+    }
+
+    void *
+    kmem_cache_alloc( kmem_cache_t *cache ) {
+        auto flags = arch::irq_save();
+        auto cpu   = arch::this_cpu();
+        auto pc    = &cache->cpu[cpu];
+
+        if( !pc->partial && pc->remote_free )
+            drain_remote( pc );
+
+        slab_t *slab = pc->partial;
+        if( !slab )
+            slab = slab_grow( cache, cpu );
+
+        slab_object *obj = slab->free;
+        slab->free = obj->next;
+        slab->inuse++;
+
+        if( !slab->free )
+            partial_remove( pc, slab );
+
+        arch::irq_restore( flags );
+        return obj;
+    }
+
+    void
+    kmem_cache_free( kmem_cache_t *cache, void *ptr ) {
+        slab_t *slab = slab_of( ptr );
+        auto    obj  = reinterpret_cast<slab_object *>(ptr);
+
+        if( slab->magic != SLAB_MAGIC || slab->cache != cache ) {
+            klog::error<klog::slab>( "bogus free of 0x%lX to %s\n", ptr, cache->name );
+            return;
+        }
+
+        auto flags = arch::irq_save();
+
+        if( slab->cpu == arch::this_cpu() ) {
+            slab_free_local( &cache->cpu[slab->cpu], slab, obj );
+        } else {
+            auto remote = &cache->cpu[slab->cpu].remote_free;
+
+            obj->next = __atomic_load_n( remote, __ATOMIC_RELAXED );
+            while( !__atomic_compare_exchange_n( remote, &obj->next, obj, true,
+                                                 __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+                ;
+        }
+
+        arch::irq_restore( flags );
+    }
+
+    kmem_cache_t *
+    kmalloc_cache( size_t size ) {
+        size_t shift = KMALLOC_MIN_SHIFT;
+        while( (1UL << shift) < size )
+            shift++;
+        return kmalloc_caches[shift - KMALLOC_MIN_SHIFT];
+    }
+
+    void
+    init_slab() {
+        for( auto shift = KMALLOC_MIN_SHIFT; shift <= KMALLOC_MAX_SHIFT; shift++ )
+            kmalloc_caches[shift - KMALLOC_MIN_SHIFT] =
+                kmem_cache_create( kmalloc_names[shift - KMALLOC_MIN_SHIFT], 1UL << shift );
+
+        klog::info<klog::slab>( "%d kmalloc size classes (%d-%d bytes)\n",
+                KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1, 1 << KMALLOC_MIN_SHIFT, KMALLOC_MAX_SMALL );
+    }
+}
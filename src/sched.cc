@@ -3,8 +3,16 @@ export module sched;
 import types;
 import lib.string;
 import lib.print;
+import lib.log;
+import lib.spinlock;
+import lib.trace;
+import arch.cpu;
+import arch.fpu;
+import arch.lapic;
+import arch.time;
+import timer;
 import arch.gdt;
-import mm.heap;
+import mm.slab;
 import arch.idt;
 
 export namespace sched {
@@ -15,256 +23,735 @@ export namespace sched {
         TASK_TERMINATED
     };
 
-    struct task_context_t {
-        uint64_t rax, rbx, rcx, rdx;
-        uint64_t rsi, rdi, rbp, rsp;
-        uint64_t r8, r9, r10, r11;
-        uint64_t r12, r13, r14, r15;
-        uint64_t rip, rflags;
-        uint16_t cs, ss, ds, es, fs, gs;
-        uint16_t padding;  // Add explicit padding for alignment
-    } __attribute__((packed));
-
-    struct task_t {
-        uint32_t pid;
+    /*
+     * Scheduling classes, in the order they get the CPU:
+     *  - SCHED_DEADLINE: EDF among tasks with a runtime/period reservation.
+     *    A task that exhausts its runtime is throttled until its next
+     *    period, and admission keeps each CPU's reservations below
+     *    DL_BW_LIMIT, so every deadline task gets its runtime per period.
+     *  - SCHED_RT: fixed priorities 0..NR_RT_PRIO-1, run until they block
+     *    or a higher priority wakes, no timeslice.
+     *  - SCHED_NORMAL: priorities NR_RT_PRIO..IDLE_PRIO, round-robin
+     *    within a level.
+     */
+    enum sched_class_t : uint8_t {
+        SCHED_NORMAL = 0,
+        SCHED_RT,
+        SCHED_DEADLINE
+    };
+
+    // Priority levels, 0 is the highest
+    constexpr auto NR_PRIO      = 32;
+    constexpr auto NR_RT_PRIO   = 8;            // levels reserved for SCHED_RT
+    constexpr auto DEFAULT_PRIO = 16;
+    constexpr auto IDLE_PRIO    = NR_PRIO - 1;  // per-CPU idle tasks only
+
+    // Deadline bandwidth, runtime/period in 1/2^DL_BW_SHIFT units
+    constexpr auto DL_BW_SHIFT  = 20;
+    constexpr auto DL_BW_LIMIT  = (95UL << DL_BW_SHIFT) / 100;
+
+    constexpr auto TIMESLICE_NS = 10000000UL;     // 10ms
+
+    // A switched-out task's registers live on its own stack: the interrupt
+    // frame if it was preempted, plus the callee-saved registers pushed by
+    // switch_to. The fields used on every switch share the first line.
+    struct alignas(64) task_t {
+        uint64_t rsp;               // saved stack pointer while not running
+        struct task_t *rq_next;     // run queue links, valid while queued
+        struct task_t *rq_prev;
         task_state_t state;
-        task_context_t context;
+        uint32_t cpu;               // CPU whose run queue the task last used
+        uint8_t priority;
+        sched_class_t policy;
+        uint32_t pid;
         void *stack_base;
         size_t stack_size;
-        struct task_t *next;
-    } __attribute__((packed));
+        struct task_t *next;        // ring of all tasks
+        void *fpu_state;            // allocated on the first FPU use
+
+        // SCHED_DEADLINE parameters and state
+        uint64_t dl_runtime;        // budget per period, ns
+        uint64_t dl_period;
+        uint64_t dl_bw;             // share of its CPU reserved at admission
+        uint64_t dl_deadline;       // absolute, ktime_ns(); EDF key
+        int64_t dl_budget;          // runtime left in this period
+        uint64_t exec_start;        // when the budget was last charged, 0 if not running
+        bool dl_throttled;          // out of budget until dl_timer fires
+        timer::timer_t dl_timer;
+    };
+
+    // Per-CPU run queue: one FIFO per priority plus a bitmap of the
+    // non-empty levels, so the next task is found with a single bit scan.
+    // Deadline tasks are kept on a list sorted by deadline instead and
+    // stay on their CPU.
+    // The running task is not queued. Taken from the timer interrupt, so
+    // task context must hold `lock` with interrupts off.
+    struct alignas(64) run_queue_t {
+        spinlock_t lock;
+        task_t *current;
+        task_t *fpu_owner;          // task whose FPU state is live, CR0.TS clear
+        task_t *head[NR_PRIO];
+        task_t *tail[NR_PRIO];
+        uint32_t bitmap;
+        task_t *dl_head;            // queued SCHED_DEADLINE tasks by deadline
+        uint64_t dl_bw;             // admitted deadline bandwidth
+        uint32_t nr_running;
+        uint64_t nr_stolen;
+        timer::timer_t slice_timer; // end of the current timeslice
+        bool slice_over;            // slice_timer fired since the last pick
+    };
+
+    mm::kmem_cache_t *task_cache = nullptr;
+
+    run_queue_t runqueues[MAX_CPU];
+    uint64_t online_cpus = 0;       // bit per CPU taking part in scheduling
+    uint64_t idle_cpus = 0;         // bit per CPU running its idle task
 
-    task_t *current_task = nullptr;
     task_t *task_queue = nullptr;
     uint32_t next_pid = 1;
     bool scheduler_ready = false;
 
+    // Protects the task_queue ring of all tasks
+    spinlock_t tasks_lock{ "tasks" };
+
+    inline run_queue_t*
+    this_rq() {
+        return &runqueues[arch::this_cpu()];
+    }
+
+    // Queue `task` at the tail of its level, or at the head for an RT task
+    // that was preempted and keeps its place in the FIFO
+    void
+    enqueue_task(run_queue_t *rq, task_t *task, bool head = false) {
+        rq->nr_running++;
+        task->cpu = rq - runqueues;
+
+        if (task->policy == SCHED_DEADLINE) {
+            task_t **link = &rq->dl_head;
+            task_t *prev = nullptr;
+            while (*link && (*link)->dl_deadline <= task->dl_deadline) {
+                prev = *link;
+                link = &prev->rq_next;
+            }
+
+            task->rq_prev = prev;
+            task->rq_next = *link;
+            if (*link)
+                (*link)->rq_prev = task;
+            *link = task;
+            return;
+        }
+
+        auto prio = task->priority;
+
+        if (head) {
+            task->rq_prev = nullptr;
+            task->rq_next = rq->head[prio];
+            if (rq->head[prio])
+                rq->head[prio]->rq_prev = task;
+            else
+                rq->tail[prio] = task;
+            rq->head[prio] = task;
+        } else {
+            task->rq_next = nullptr;
+            task->rq_prev = rq->tail[prio];
+            if (rq->tail[prio])
+                rq->tail[prio]->rq_next = task;
+            else
+                rq->head[prio] = task;
+            rq->tail[prio] = task;
+        }
+
+        rq->bitmap |= 1U << prio;
+    }
+
+    void
+    dequeue_task(run_queue_t *rq, task_t *task) {
+        rq->nr_running--;
+
+        if (task->policy == SCHED_DEADLINE) {
+            if (task->rq_prev)
+                task->rq_prev->rq_next = task->rq_next;
+            else
+                rq->dl_head = task->rq_next;
+            if (task->rq_next)
+                task->rq_next->rq_prev = task->rq_prev;
+            task->rq_next = task->rq_prev = nullptr;
+            return;
+        }
+
+        auto prio = task->priority;
+
+        if (task->rq_prev)
+            task->rq_prev->rq_next = task->rq_next;
+        else
+            rq->head[prio] = task->rq_next;
+        if (task->rq_next)
+            task->rq_next->rq_prev = task->rq_prev;
+        else
+            rq->tail[prio] = task->rq_prev;
+        task->rq_next = task->rq_prev = nullptr;
+
+        if (!rq->head[prio])
+            rq->bitmap &= ~(1U << prio);
+    }
+
+    // Highest-priority queued RT or normal task
+    task_t*
+    pick_next_prio(run_queue_t *rq) {
+        if (!rq->bitmap)
+            return nullptr;
+        return rq->head[__builtin_ctz(rq->bitmap)];
+    }
+
+    // Next task by class order, or nullptr if nothing is runnable
+    task_t*
+    pick_next_task(run_queue_t *rq) {
+        if (rq->dl_head)
+            return rq->dl_head;
+        return pick_next_prio(rq);
+    }
+
+    // Should the queued task `next` take the CPU from the running `curr`?
+    // Equal normal priorities take turns once `slice_over`, RT ones never;
+    // a wakeup alone only preempts a lower priority.
+    bool
+    should_preempt(task_t *next, task_t *curr, bool slice_over) {
+        if (next->policy == SCHED_DEADLINE)
+            return curr->policy != SCHED_DEADLINE || next->dl_deadline < curr->dl_deadline;
+        if (curr->policy == SCHED_DEADLINE)
+            return false;
+        if (curr->policy == SCHED_RT)
+            return next->priority < curr->priority;
+        return slice_over ? next->priority <= curr->priority : next->priority < curr->priority;
+    }
+
+    // Does anything queued on `rq` want a CPU the current task would not
+    // give up by itself? Only then is a timeslice tick needed.
+    bool
+    needs_tick(run_queue_t *rq) {
+        task_t *next = pick_next_task(rq);
+        return next && should_preempt(next, rq->current, true);
+    }
+
+    /*
+     * Tickless operation: keep a timer for the end of the slice only while
+     * another task is waiting for this CPU, so an idle or uncontended CPU
+     * is not interrupted at all. `restart` begins a new slice. Caller holds
+     * rq->lock.
+     */
+    void
+    update_tick(run_queue_t *rq, bool restart) {
+        task_t *curr = rq->current;
+
+        // A deadline task always needs its budget enforced
+        if (curr->policy == SCHED_DEADLINE) {
+            int64_t left = curr->dl_budget > 0 ? curr->dl_budget : 0;
+            timer::add_timer(&rq->slice_timer, curr->exec_start + left);
+            return;
+        }
+
+        if (!needs_tick(rq))
+            timer::del_timer(&rq->slice_timer);
+        else if (restart || !rq->slice_timer.pending)
+            timer::add_timer(&rq->slice_timer, arch::ktime_ns() + TIMESLICE_NS);
+    }
+
+    // The interrupt that runs it ends in schedule(), which now lets an
+    // equal-priority task have its turn
+    void
+    slice_expired(void *data) {
+        static_cast<run_queue_t *>(data)->slice_over = true;
+    }
+
+    // Make `rq` reschedule soon if `task`, just queued there, should run
+    // instead of its current task; a self-IPI fires as soon as the caller
+    // re-enables interrupts. An equal-priority task waits for the end of
+    // the slice, which a remote CPU may first have to start timing: the
+    // IPI's schedule() keeps the current task and arms the tick. Caller
+    // holds rq->lock.
+    void
+    check_preempt(run_queue_t *rq, task_t *task) {
+        if (should_preempt(task, rq->current, false))
+            arch::lapic_send_resched(rq - runqueues);
+        else if (rq == this_rq())
+            update_tick(rq, false);
+        else if (needs_tick(rq) && !__atomic_load_n(&rq->slice_timer.pending, __ATOMIC_RELAXED))
+            arch::lapic_send_resched(rq - runqueues);
+    }
+
+    // Lock the run queue `task` belongs to, following it if it migrates
+    run_queue_t*
+    lock_task_rq(task_t *task, uint64_t &flags) {
+        for (;;) {
+            run_queue_t *rq = &runqueues[__atomic_load_n(&task->cpu, __ATOMIC_RELAXED)];
+            flags = rq->lock.lock_irqsave();
+
+            if (rq == &runqueues[task->cpu])
+                return rq;
+            rq->lock.release_irqrestore(flags);
+        }
+    }
+
+    // Make a blocked task on `rq` runnable. Caller holds rq->lock.
+    void
+    activate_task(run_queue_t *rq, task_t *task) {
+        if (rq->current == task) {
+            // Never switched out, see schedule()
+            task->state = TASK_RUNNING;
+            if (task->policy == SCHED_DEADLINE && !task->exec_start)
+                task->exec_start = arch::ktime_ns();
+            return;
+        }
+
+        task->state = TASK_READY;
+        enqueue_task(rq, task);
+        check_preempt(rq, task);
+    }
+
+    // Out of budget: sit out the rest of the period. Caller holds rq->lock.
+    void
+    dl_throttle(task_t *task) {
+        task->state = TASK_BLOCKED;
+        task->dl_throttled = true;
+        task->exec_start = 0;
+        timer::add_timer(&task->dl_timer, task->dl_deadline);
+    }
+
+    // Start of a throttled task's next period: refill and run it again
+    void
+    dl_replenish(void *data) {
+        task_t *task = (task_t*)data;
+        uint64_t flags;
+        run_queue_t *rq = lock_task_rq(task, flags);
+
+        if (task->dl_throttled && task->policy == SCHED_DEADLINE) {
+            uint64_t now = arch::ktime_ns();
+
+            task->dl_deadline += task->dl_period;
+            if (task->dl_deadline <= now)
+                task->dl_deadline = now + task->dl_period;
+
+            task->dl_budget += task->dl_runtime;
+            if (task->dl_budget > (int64_t)task->dl_runtime)
+                task->dl_budget = task->dl_runtime;
+
+            if (task->dl_budget > 0) {
+                task->dl_throttled = false;
+                activate_task(rq, task);
+            } else {
+                timer::add_timer(&task->dl_timer, task->dl_deadline);
+            }
+        }
+
+        rq->lock.release_irqrestore(flags);
+    }
+
+    // Take a task out of the deadline class. Caller holds rq->lock and
+    // has dequeued the task.
+    void
+    leave_deadline(run_queue_t *rq, task_t *task) {
+        rq->dl_bw -= task->dl_bw;
+        task->dl_bw = 0;
+        timer::del_timer(&task->dl_timer);
+
+        if (task->dl_throttled) {
+            task->dl_throttled = false;
+            task->state = rq->current == task ? TASK_RUNNING : TASK_READY;
+        }
+    }
+
+    /*
+     * A deadline task waking after a sleep keeps its deadline and budget
+     * unless running out the budget by that deadline would exceed its
+     * reserved bandwidth; then it starts a fresh period (the CBS rule).
+     */
+    void
+    dl_wakeup(task_t *task) {
+        uint64_t now = arch::ktime_ns();
+
+        if (task->dl_deadline <= now ||
+            (unsigned __int128)(task->dl_budget > 0 ? task->dl_budget : 0) * task->dl_period >
+            (unsigned __int128)task->dl_runtime * (task->dl_deadline - now)) {
+            task->dl_deadline = now + task->dl_period;
+            task->dl_budget = task->dl_runtime;
+        }
+    }
+
+    // Charge the running deadline task for its CPU time since exec_start
+    // and throttle it once the budget is gone. Caller holds rq->lock.
+    void
+    update_curr(run_queue_t *rq) {
+        task_t *curr = rq->current;
+        if (curr->policy != SCHED_DEADLINE || !curr->exec_start)
+            return;
+
+        uint64_t now = arch::ktime_ns();
+        curr->dl_budget -= now - curr->exec_start;
+        curr->exec_start = curr->state == TASK_RUNNING ? now : 0;
+
+        if (curr->dl_budget <= 0 && curr->state == TASK_RUNNING)
+            dl_throttle(curr);
+    }
+
+    void
+    update_idle(run_queue_t *rq) {
+        uint64_t bit = 1UL << (rq - runqueues);
+
+        if (rq->current->priority == IDLE_PRIO)
+            __atomic_fetch_or(&idle_cpus, bit, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_and(&idle_cpus, ~bit, __ATOMIC_RELAXED);
+    }
+
+    // Idle CPUs take no ticks, so one has to be told when there is work
+    // it could steal (see steal_task()). The CPU index doubles as its
+    // APIC ID.
+    void
+    kick_idle_cpu(run_queue_t *rq) {
+        if (rq->nr_running < 2 || !(rq->bitmap & ~(1U << IDLE_PRIO)))
+            return;
+
+        uint64_t idle = __atomic_load_n(&idle_cpus, __ATOMIC_RELAXED) & ~(1UL << (rq - runqueues));
+        if (idle)
+            arch::lapic_send_resched(__builtin_ctzll(idle));
+    }
+
+    /*
+     * Move one task from the busiest sibling to `rq`, which has nothing
+     * queued. Tasks stay on their last CPU unless the sibling has more
+     * than one waiting, and a sibling whose lock is busy is skipped rather
+     * than waited for. Called without any run queue lock held.
+     */
+    bool
+    steal_task(run_queue_t *rq) {
+        uint32_t self = rq - runqueues;
+        uint32_t busiest = self;
+        uint32_t most = 1;
+
+        for (uint64_t mask = online_cpus & ~(1UL << self); mask; mask &= mask - 1) {
+            uint32_t cpu = __builtin_ctzll(mask);
+            uint32_t n = __atomic_load_n(&runqueues[cpu].nr_running, __ATOMIC_RELAXED);
+            if (n > most) {
+                most = n;
+                busiest = cpu;
+            }
+        }
+
+        if (busiest == self)
+            return false;
+
+        run_queue_t *victim = &runqueues[busiest];
+
+        // Both locks are held for the move, so a queued task is on exactly
+        // one run queue at any time. Trying the victim's lock cannot
+        // deadlock against a sibling stealing the other way.
+        rq->lock.lock();
+        if (!victim->lock.try_lock()) {
+            rq->lock.release();
+            return false;
+        }
+
+        // The task that has waited longest is the least cache-hot one.
+        // Idle tasks belong to their CPU and are never moved, neither are
+        // deadline tasks, whose bandwidth was admitted on that CPU.
+        task_t *task = victim->nr_running > 1 ? pick_next_prio(victim) : nullptr;
+        if (task && task->priority == IDLE_PRIO)
+            task = nullptr;
+        if (task) {
+            dequeue_task(victim, task);
+            enqueue_task(rq, task);
+            rq->nr_stolen++;
+        }
+
+        victim->lock.release();
+        rq->lock.release();
+        return task != nullptr;
+    }
+
     void
     print_task_queue();
     
     void
-    init_kernel_task(task_t *task) {
+    init_kernel_task(task_t *task, uint8_t priority = DEFAULT_PRIO) {
         if (!task) {
-            printk("[SCHED] ERROR: Cannot initialize null task\n");
+            klog::error<klog::sched>("Cannot initialize null task\n");
             return;
         }
         
         // Check if the task address looks reasonable (not in low memory)
         if ((uint64_t)task < 0x1000) {
-            printk("[SCHED] ERROR: Task address 0x%x looks invalid (too low)\n", task);
+            klog::error<klog::sched>("Task address 0x%x looks invalid (too low)\n", task);
             return;
         }
         
-        printk("[SCHED] Task structure sizes: task_t=%d, task_context_t=%d\n", 
-               sizeof(task_t), sizeof(task_context_t));
+        klog::debug<klog::sched>("Task structure size: task_t=%d\n", sizeof(task_t));
         
-        printk("[SCHED] Before memset: task=0x%x, end=0x%x\n", task, (uint64_t)task + sizeof(task_t));
+        klog::debug<klog::sched>("Before memset: task=0x%x, end=0x%x\n", task, (uint64_t)task + sizeof(task_t));
         
         // Try to write to the memory first as a test
         volatile uint8_t *test_ptr = (volatile uint8_t*)task;
-        printk("[SCHED] Testing memory write at 0x%x\n", test_ptr);
+        klog::debug<klog::sched>("Testing memory write at 0x%x\n", test_ptr);
         *test_ptr = 0xFF;  // Test write
         uint8_t test_val = *test_ptr;  // Test read
-        printk("[SCHED] Memory test result: wrote 0xFF, read 0x%x\n", test_val);
+        klog::debug<klog::sched>("Memory test result: wrote 0xFF, read 0x%x\n", test_val);
         
         memset(task, 0, sizeof(task_t));
-        printk("[SCHED] After memset\n");
+        klog::debug<klog::sched>("After memset\n");
         
         task->pid = 0;  // Kernel task gets PID 0
         task->state = TASK_RUNNING;
         task->stack_base = nullptr;  // Kernel uses its own stack
         task->stack_size = 0;
         task->next = task;  // Point to itself initially
+        task->priority = priority;
+        task->cpu = arch::this_cpu();
+        timer::init_timer(&runqueues[task->cpu].slice_timer, slice_expired, &runqueues[task->cpu]);
+        timer::init_timer(&task->dl_timer, dl_replenish, task);
+
+        // The boot CPU gets here before any other CPU runs or creates tasks
+        if (task->cpu == 0)
+            task_cache = mm::kmem_cache_create("task_t", sizeof(task_t), alignof(task_t));
         
-        printk("[SCHED] Basic fields set\n");
-        
-        // Initialize context to current CPU state
-        task->context.rflags = 0x202;
-        task->context.cs = 0x08;
-        task->context.ss = 0x10;
-        task->context.ds = task->context.es = task->context.fs = task->context.gs = 0x10;
-        
-        printk("[SCHED] Context initialized\n");
+        klog::debug<klog::sched>("Basic fields set\n");
         
-        // Set this as the task queue head
-        task_queue = task;
+        // The first one becomes the task queue head, later CPUs link in
+        {
+            spinlock_irq_guard guard(tasks_lock);
+
+            if (!task_queue) {
+                task_queue = task;
+            } else {
+                task->next = task_queue->next;
+                task_queue->next = task;
+            }
+        }
+
+        __atomic_fetch_or(&online_cpus, 1UL << task->cpu, __ATOMIC_RELEASE);
         
-        printk("[SCHED] Initialized kernel task at 0x%x as task queue head\n", task);
+        klog::info<klog::sched>("Initialized kernel task at 0x%x for CPU %d\n", task, task->cpu);
     }
 
+    extern "C" void switch_to(uint64_t *prev_rsp, uint64_t next_rsp);
+    extern "C" void task_start();
+
     task_t*
-    create_task( void *entry_point, void *user_stack, size_t stack_size ) {
-        task_t *task = (task_t*)mm::kmalloc(sizeof(task_t));
+    create_task( void *entry_point, void *user_stack, size_t stack_size, uint8_t priority = DEFAULT_PRIO ) {
+        task_t *task = (task_t*)mm::kmem_cache_alloc(task_cache);
         if (!task) {
-            printk("[SCHED] Failed to allocate task\n");
+            klog::error<klog::sched>("Failed to allocate task\n");
             return nullptr;
         }
         
         memset(task, 0, sizeof(task_t));
         task->pid = next_pid++;
         task->state = TASK_READY;
-        
-        // Mark this as a new task that hasn't been interrupted yet
-        task->context.rax = 0xDEADBEEF;  // Use a magic marker to identify new tasks
+        task->priority = priority < NR_RT_PRIO ? NR_RT_PRIO : priority < IDLE_PRIO ? priority : IDLE_PRIO - 1;
+        task->policy = SCHED_NORMAL;
+        timer::init_timer(&task->dl_timer, dl_replenish, task);
         task->stack_base = user_stack;
         task->stack_size = stack_size;
         
-        task->context.rip = (uint64_t)entry_point;
-        task->context.rsp = (uint64_t)user_stack + stack_size - 16;
-        task->context.rflags = 0x202;
-        task->context.cs = 0x08;
-        task->context.ss = 0x10;
-        task->context.ds = task->context.es = task->context.fs = task->context.gs = 0x10;
-        
-        printk("[SCHED] Task setup: entry=0x%x, rsp=0x%x, stack_base=0x%x\n", 
-               task->context.rip, task->context.rsp, user_stack);
-        
-        if (!task_queue) {
-            task->next = task;
-            task_queue = task;
-        } else {
-            task_t *last = task_queue;
-            while (last->next != task_queue) {
-                last = last->next;
+        // The first switch_to into the task pops this frame and "returns"
+        // to task_start, which calls the entry point kept in r12
+        uint64_t *sp = (uint64_t*)(((uint64_t)user_stack + stack_size) & ~15UL);
+        *--sp = (uint64_t)&task_start;
+        *--sp = 0;                          // rbp
+        *--sp = 0;                          // rbx
+        *--sp = (uint64_t)entry_point;      // r12
+        *--sp = 0;                          // r13
+        *--sp = 0;                          // r14
+        *--sp = 0;                          // r15
+        task->rsp = (uint64_t)sp;
+        
+        klog::debug<klog::sched>("Task setup: entry=0x%x, rsp=0x%x, stack_base=0x%x\n", 
+               entry_point, task->rsp, user_stack);
+        
+        {
+            spinlock_irq_guard guard(tasks_lock);
+
+            if (!task_queue) {
+                task->next = task;
+                task_queue = task;
+            } else {
+                task->next = task_queue->next;
+                task_queue->next = task;
+            }
+        }
+
+        // New tasks start on the creating CPU; idle siblings steal them
+        {
+            run_queue_t *rq = this_rq();
+            spinlock_irq_guard guard(rq->lock);
+            enqueue_task(rq, task);
+
+            if (scheduler_ready) {
+                update_tick(rq, false);
+                kick_idle_cpu(rq);
             }
-            task->next = task_queue;
-            last->next = task;
         }
         
-        printk("[SCHED] Created task PID %d, entry=0x%x, stack=0x%x\n", 
+        klog::debug<klog::sched>("Created task PID %d, entry=0x%x, stack=0x%x\n", 
                task->pid, entry_point, user_stack);
         
         return task;
     }
 
-    extern "C" void switch_context(task_context_t *old_ctx, task_context_t *new_ctx);
-
-    void
-    save_interrupt_context(arch::interrupt_context *int_ctx, task_context_t *task_ctx) {
-        task_ctx->rax = int_ctx->regs.rax;
-        task_ctx->rbx = int_ctx->regs.rbx;
-        task_ctx->rcx = int_ctx->regs.rcx;
-        task_ctx->rdx = int_ctx->regs.rdx;
-        task_ctx->rsi = int_ctx->regs.rsi;
-        task_ctx->rdi = int_ctx->regs.rdi;
-        task_ctx->rbp = int_ctx->regs.rbp;
-        task_ctx->r8 = int_ctx->regs.r8;
-        task_ctx->r9 = int_ctx->regs.r9;
-        task_ctx->r10 = int_ctx->regs.r10;
-        task_ctx->r11 = int_ctx->regs.r11;
-        task_ctx->r12 = int_ctx->regs.r12;
-        task_ctx->r13 = int_ctx->regs.r13;
-        task_ctx->r14 = int_ctx->regs.r14;
-        task_ctx->r15 = int_ctx->regs.r15;
-        task_ctx->rip = int_ctx->rip;
-        task_ctx->rsp = int_ctx->rsp;
-        task_ctx->rflags = int_ctx->rflags;
-        task_ctx->cs = int_ctx->cs;
-        task_ctx->ss = int_ctx->ss;
-        
-        printk("[SCHED] Saving task context: RIP=0x%x, RSP=0x%x\n", int_ctx->rip, int_ctx->rsp);
+    // Second half of a switch, run by the incoming task: drop the run queue
+    // lock the outgoing task took. The incoming task may have last run on
+    // another CPU, so the queue is looked up again.
+    extern "C" void
+    sched_finish_switch() {
+        this_rq()->lock.release();
     }
 
-    void
-    restore_interrupt_context(task_context_t *task_ctx, arch::interrupt_context *int_ctx) {
-        int_ctx->regs.rax = task_ctx->rax;
-        int_ctx->regs.rbx = task_ctx->rbx;
-        int_ctx->regs.rcx = task_ctx->rcx;
-        int_ctx->regs.rdx = task_ctx->rdx;
-        int_ctx->regs.rsi = task_ctx->rsi;
-        int_ctx->regs.rdi = task_ctx->rdi;
-        int_ctx->regs.rbp = task_ctx->rbp;
-        int_ctx->regs.r8 = task_ctx->r8;
-        int_ctx->regs.r9 = task_ctx->r9;
-        int_ctx->regs.r10 = task_ctx->r10;
-        int_ctx->regs.r11 = task_ctx->r11;
-        int_ctx->regs.r12 = task_ctx->r12;
-        int_ctx->regs.r13 = task_ctx->r13;
-        int_ctx->regs.r14 = task_ctx->r14;
-        int_ctx->regs.r15 = task_ctx->r15;
-        int_ctx->rip = task_ctx->rip;
-        int_ctx->rsp = task_ctx->rsp;
-        int_ctx->rflags = task_ctx->rflags;
-        int_ctx->cs = task_ctx->cs;
-        int_ctx->ss = task_ctx->ss;
-        
-        printk("[SCHED] Restoring task context: RIP=0x%x, RSP=0x%x\n", task_ctx->rip, task_ctx->rsp);
+    // Pick the task to run instead of rq->current and requeue the latter.
+    // Returns nullptr if the current task should keep the CPU. Caller holds
+    // rq->lock.
+    task_t*
+    switch_target(run_queue_t *rq) {
+        task_t *current = rq->current;
+        task_t *next_task = pick_next_task(rq);
+
+        bool slice_over = rq->slice_over;
+        rq->slice_over = false;
+
+        if (!next_task)
+            return nullptr;
+
+        if (current->state == TASK_RUNNING) {
+            if (!should_preempt(next_task, current, slice_over))
+                return nullptr;
+
+            current->state = TASK_READY;
+            enqueue_task(rq, current, current->policy == SCHED_RT);
+        }
+
+        dequeue_task(rq, next_task);
+        return next_task;
     }
 
     void
     schedule() {
-        if (!current_task || !task_queue) return;
-        
-        task_t *next_task = current_task->next;
-        if (!next_task) next_task = task_queue;
-        
-        if (next_task != current_task && next_task->state == TASK_READY) {
-            task_t *prev_task = current_task;
-            prev_task->state = TASK_READY;
-            
-            current_task = next_task;
-            current_task->state = TASK_RUNNING;
-            
-            switch_context(&prev_task->context, &current_task->context);
+        auto flags = arch::irq_save();
+        run_queue_t *rq = this_rq();
+
+        if (!rq->current) {
+            arch::irq_restore(flags);
+            return;
         }
+
+        task_t *next_task;
+
+        for (;;) {
+            if (!rq->nr_running)
+                steal_task(rq);
+
+            rq->lock.lock();
+            update_curr(rq);
+
+            next_task = switch_target(rq);
+            if (next_task)
+                break;
+
+            if (rq->current->state == TASK_RUNNING) {
+                update_tick(rq, false);
+                rq->lock.release_irqrestore(flags);
+                return;
+            }
+
+            // Blocked with nothing else to run (no idle task on this CPU):
+            // wait in place until wake_up() makes it runnable again
+            rq->lock.release();
+            asm volatile("sti; hlt; cli" ::: "memory");
+        }
+
+        task_t *prev_task = rq->current;
+        rq->current = next_task;
+        next_task->state = TASK_RUNNING;
+        if (next_task->policy == SCHED_DEADLINE)
+            next_task->exec_start = arch::ktime_ns();
+
+        update_tick(rq, true);
+        update_idle(rq);
+        kick_idle_cpu(rq);
+
+        // Lazy FPU: only a task that used the FPU during this slice gets its
+        // state saved, and the next user traps to load its own.
+        if (rq->fpu_owner) {
+            arch::fpu_save(rq->fpu_owner->fpu_state);
+            arch::fpu_disable();
+            rq->fpu_owner = nullptr;
+        }
+
+        trace::emit(trace::EV_SWITCH, prev_task->pid, next_task->pid, prev_task->state);
+
+        // rq->lock stays held across the switch so that no other CPU can
+        // steal prev_task before its stack pointer is saved. Whatever runs
+        // next on this CPU drops it, see sched_finish_switch().
+        switch_to(&prev_task->rsp, next_task->rsp);
+
+        sched_finish_switch();
+        arch::irq_restore(flags);
     }
 
+    /*
+     * Preempt the current task from an interrupt handler. The interrupted
+     * state stays in the interrupt frame on the task's stack and is only
+     * returned through once the task is switched back in, so the handler
+     * must have sent its EOI before calling this.
+     */
     void
-    schedule_from_interrupt(arch::interrupt_context *ctx) {
+    schedule_from_interrupt() {
         if (!scheduler_ready) {
             return; // Silently ignore until scheduler is ready
         }
-        
-        if (!current_task) {
-            printk("[SCHED] No current task\n");
-            return;
-        }
-        
-        if (!task_queue) {
-            printk("[SCHED] No task queue\n");
-            return;
-        }
-        
-        task_t *next_task = current_task->next;
-        if (!next_task) {
-            printk("[SCHED] WARNING: current_task->next is null, using task_queue\n");
-            next_task = task_queue;
-        }
-        
-        if (!next_task) {
-            printk("[SCHED] ERROR: No valid next task found\n");
-            return;
-        }
-        
-        printk("[SCHED] Current: PID %d (0x%x), Next: PID %d (0x%x)\n", 
-               current_task->pid, current_task, next_task->pid, next_task);
-        
-        if (next_task != current_task && next_task->state == TASK_READY) {
-            printk("[SCHED] Switching from PID %d to PID %d\n", 
-                   current_task->pid, next_task->pid);
-                   
-            save_interrupt_context(ctx, &current_task->context);
-            current_task->state = TASK_READY;
-            
-            current_task = next_task;
-            current_task->state = TASK_RUNNING;
-            
-            // Check if this is a new task that hasn't run yet
-            if (current_task->context.rax == 0xDEADBEEF) {
-                printk("[SCHED] First-time scheduling task PID %d, preserving entry point 0x%x\n", 
-                       current_task->pid, current_task->context.rip);
-                // Clear the marker
-                current_task->context.rax = 0;
-            }
-            
-            restore_interrupt_context(&current_task->context, ctx);
-        } else {
-            if (next_task == current_task) {
-                printk("[SCHED] Only one task in queue\n");
-            } else {
-                printk("[SCHED] Next task not ready, state: %d\n", next_task->state);
-            }
-        }
+
+        schedule();
+    }
+
+    // #NM: the current task used the FPU while CR0.TS was set. Any other
+    // task's state was saved when it was switched out.
+    void
+    fpu_trap(arch::interrupt_context *ctx) {
+        run_queue_t *rq = this_rq();
+        task_t *task = rq->current;
+
+        if (!task->fpu_state)
+            task->fpu_state = arch::fpu_state_alloc();
+
+        arch::fpu_enable();
+        arch::fpu_restore(task->fpu_state);
+        rq->fpu_owner = task;
+    }
+
+    // Another CPU queued work this idle CPU may steal. Entered from the
+    // isr_resched fast stub, not through handle_interrupt().
+    extern "C" void
+    sched_resched_interrupt(uint64_t rip) {
+        trace::emit(trace::EV_IRQ_ENTRY, arch::RESCHED_VECTOR, rip);
+        arch::lapic_eoi(0);
+        // Before the switch, which may not return here for a while
+        trace::emit(trace::EV_IRQ_EXIT, arch::RESCHED_VECTOR);
+        schedule_from_interrupt();
+    }
+
+    // A task's entry point returned
+    extern "C" [[noreturn]] void
+    sched_task_exit() {
+        arch::disable_interrupts();
+
+        run_queue_t *rq = this_rq();
+        rq->lock.lock();
+        if (rq->current->policy == SCHED_DEADLINE)
+            leave_deadline(rq, rq->current);
+        rq->current->state = TASK_TERMINATED;
+        rq->lock.release();
+
+        schedule();
+
+        panic("sched_task_exit: terminated task was scheduled again");
+        __builtin_unreachable();
     }
 
     void
@@ -275,26 +762,200 @@ export namespace sched {
 
     task_t*
     get_current_task() {
-        return current_task;
+        return this_rq()->current;
+    }
+
+    /*
+     * Make a blocked task runnable again on the CPU it last ran on. Returns
+     * false if it was not blocked. A task that set TASK_BLOCKED but has not
+     * switched out yet simply keeps running. Safe from any CPU and from
+     * interrupt context.
+     */
+    bool
+    wake_up(task_t *task) {
+        uint64_t flags;
+        run_queue_t *rq = lock_task_rq(task, flags);
+
+        // A throttled deadline task only runs again when replenished
+        bool woken = task->state == TASK_BLOCKED && !task->dl_throttled;
+        if (woken) {
+            if (task->policy == SCHED_DEADLINE && rq->current != task)
+                dl_wakeup(task);
+            activate_task(rq, task);
+        }
+
+        rq->lock.release_irqrestore(flags);
+        return woken;
+    }
+
+    /*
+     * Move a task to SCHED_NORMAL or SCHED_RT at `priority`, which is
+     * clamped into the range of the class. Takes effect immediately, also
+     * for a running or queued task.
+     */
+    void
+    set_scheduler(task_t *task, sched_class_t policy, uint8_t priority) {
+        if (policy == SCHED_RT)
+            priority = priority < NR_RT_PRIO ? priority : NR_RT_PRIO - 1;
+        else if (task->priority != IDLE_PRIO)
+            priority = priority < NR_RT_PRIO ? NR_RT_PRIO : priority < IDLE_PRIO ? priority : IDLE_PRIO - 1;
+
+        uint64_t flags;
+        run_queue_t *rq = lock_task_rq(task, flags);
+
+        if (task->state == TASK_READY)
+            dequeue_task(rq, task);
+        if (task->policy == SCHED_DEADLINE)
+            leave_deadline(rq, task);
+
+        task->policy = policy == SCHED_RT ? SCHED_RT : SCHED_NORMAL;
+        task->priority = priority;
+
+        if (task->state == TASK_READY) {
+            enqueue_task(rq, task);
+            check_preempt(rq, task);
+        } else if (rq->current == task) {
+            // The running task may have dropped below a queued one
+            task_t *next = pick_next_task(rq);
+            if (next)
+                check_preempt(rq, next);
+        }
+
+        rq->lock.release_irqrestore(flags);
+    }
+
+    /*
+     * Give a task a reservation of `runtime_ns` every `period_ns` on the
+     * CPU it is on, with the deadline at the end of each period. Fails if
+     * that CPU cannot admit the extra bandwidth.
+     */
+    bool
+    set_deadline(task_t *task, uint64_t runtime_ns, uint64_t period_ns) {
+        if (!runtime_ns || runtime_ns > period_ns || task->priority == IDLE_PRIO)
+            return false;
+
+        uint64_t bw = (uint64_t)(((unsigned __int128)runtime_ns << DL_BW_SHIFT) / period_ns);
+
+        uint64_t flags;
+        run_queue_t *rq = lock_task_rq(task, flags);
+
+        uint64_t old_bw = task->policy == SCHED_DEADLINE ? task->dl_bw : 0;
+        if (rq->dl_bw - old_bw + bw > DL_BW_LIMIT) {
+            rq->lock.release_irqrestore(flags);
+            klog::warn<klog::sched>("PID %d: deadline bandwidth exceeded on CPU %d\n", task->pid, task->cpu);
+            return false;
+        }
+
+        if (task->state == TASK_READY)
+            dequeue_task(rq, task);
+        if (task->policy == SCHED_DEADLINE)
+            leave_deadline(rq, task);
+
+        uint64_t now = arch::ktime_ns();
+        task->policy = SCHED_DEADLINE;
+        task->dl_runtime = runtime_ns;
+        task->dl_period = period_ns;
+        task->dl_bw = bw;
+        task->dl_deadline = now + period_ns;
+        task->dl_budget = runtime_ns;
+        task->exec_start = rq->current == task ? now : 0;
+        rq->dl_bw += bw;
+
+        if (task->state == TASK_READY) {
+            enqueue_task(rq, task);
+            check_preempt(rq, task);
+        } else if (rq->current == task) {
+            // Start enforcing the budget
+            if (rq == this_rq())
+                update_tick(rq, false);
+            else
+                arch::lapic_send_resched(rq - runqueues);
+        }
+
+        rq->lock.release_irqrestore(flags);
+        return true;
+    }
+
+    // Mark the current task blocked; it stops running at the next
+    // schedule() unless a wake_up() comes first
+    void
+    prepare_to_block() {
+        run_queue_t *rq = this_rq();
+        auto flags = rq->lock.lock_irqsave();
+        rq->current->state = TASK_BLOCKED;
+        rq->lock.release_irqrestore(flags);
+    }
+
+    // The current task no longer waits: back out of prepare_to_block()
+    void
+    finish_block() {
+        run_queue_t *rq = this_rq();
+        auto flags = rq->lock.lock_irqsave();
+        rq->current->state = TASK_RUNNING;
+        rq->lock.release_irqrestore(flags);
+    }
+
+    void
+    sleep_wakeup(void *data) {
+        wake_up((task_t*)data);
+    }
+
+    /*
+     * Block the current task until ktime_ns() >= deadline_ns. Before the
+     * scheduler runs this can only busy-wait.
+     */
+    void
+    sleep_until(uint64_t deadline_ns) {
+        if (!scheduler_ready) {
+            while (arch::ktime_ns() < deadline_ns)
+                arch::cpu_relax();
+            return;
+        }
+
+        timer::timer_t timer;
+        timer::init_timer(&timer, sleep_wakeup, get_current_task());
+
+        // Interrupts stay off until we are switched out, so the timer
+        // (queued on this CPU) cannot fire before the task is blocked
+        auto flags = arch::irq_save();
+        prepare_to_block();
+        timer::add_timer(&timer, deadline_ns);
+        schedule();
+        arch::irq_restore(flags);
+
+        timer::del_timer(&timer);
+    }
+
+    void
+    sleep_for(uint64_t ns) {
+        sleep_until(arch::ktime_ns() + ns);
+    }
+
+    // LAPIC timer interrupt: expire timers, then maybe switch
+    void
+    timer_interrupt() {
+        timer::run_timers();
+        schedule_from_interrupt();
     }
 
     void
     set_current_task(task_t *task) {
         if (!task) {
-            printk("[SCHED] ERROR: Attempting to set null task as current\n");
+            klog::error<klog::sched>("Attempting to set null task as current\n");
             return;
         }
         
-        printk("[SCHED] About to set current task to PID %d (at 0x%x)\n", task->pid, task);
-        printk("[SCHED] Task state before: %d\n", task->state);
+        klog::debug<klog::sched>("About to set current task to PID %d (at 0x%x)\n", task->pid, task);
+        klog::debug<klog::sched>("Task state before: %d\n", task->state);
         
-        current_task = task;
-        printk("[SCHED] Set current_task pointer\n");
+        this_rq()->current = task;
+        update_idle(this_rq());
+        klog::debug<klog::sched>("Set current_task pointer\n");
         
         task->state = TASK_RUNNING;
-        printk("[SCHED] Set task state to RUNNING\n");
+        klog::debug<klog::sched>("Set task state to RUNNING\n");
         
-        printk("[SCHED] Successfully set current task\n");
+        klog::debug<klog::sched>("Successfully set current task\n");
     }
 
     void
@@ -308,8 +969,8 @@ export namespace sched {
         task_t *t = task_queue;
         int count = 0;
         do {
-            printk("  PID %d: state=%d, next=0x%x\n", t->pid, t->state, t->next);
-            if (t == current_task) printk("    ^ CURRENT\n");
+            printk("  PID %d: state=%d, prio=%d, cpu=%d, next=0x%x\n", t->pid, t->state, t->priority, t->cpu, t->next);
+            if (t == runqueues[t->cpu].current) printk("    ^ CURRENT\n");
             t = t->next;
             count++;
         } while (t != task_queue && count < 10);
@@ -319,14 +980,23 @@ export namespace sched {
 
     void
     start_scheduler() {
-        if (!current_task || !task_queue) {
-            printk("[SCHED] ERROR: Cannot start scheduler without current task and queue\n");
+        if (!this_rq()->current || !task_queue) {
+            klog::error<klog::sched>("Cannot start scheduler without current task and queue\n");
             return;
         }
         
+        arch::register_irq_handler(7, fpu_trap);
+        arch::set_timer_callback(timer_interrupt);
+
         scheduler_ready = true;
-        printk("[SCHED] Scheduler started with %d task(s)\n", 
-               task_queue ? 1 : 0); // TODO: count tasks properly
+
+        {
+            run_queue_t *rq = this_rq();
+            spinlock_irq_guard guard(rq->lock);
+            update_tick(rq, true);
+        }
+        klog::info<klog::sched>("Scheduler started with %d runnable task(s)\n", 
+               this_rq()->nr_running + 1);
         print_task_queue();
     }
 }
\ No newline at end of file
@@ -0,0 +1,158 @@
+export module sync;
+
+import types;
+import arch.cpu;
+import lib.print;
+import sched;
+import wait;
+
+constexpr u32 MUTEX_SPIN = 64;
+
+// Sleeping locks on top of wait queues. Unlike spinlock_t they may be held
+// across anything that blocks, but must not be taken in interrupt context.
+
+/*
+ * Mutex: an uncontended lock()/unlock() is a single atomic on `owner`. A
+ * contended locker spins briefly, for the common short critical section,
+ * then sleeps until an unlock hands it a chance to retry.
+ */
+export class mutex_t {
+private:
+    sched::task_t      *owner = nullptr;
+    wait::wait_queue_t  waiters;
+
+public:
+    constexpr mutex_t() = default;
+
+    inline bool try_lock() {
+        sched::task_t *expected = nullptr;
+        return __atomic_compare_exchange_n( &owner, &expected, sched::get_current_task(), false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED );
+    }
+
+    void lock() {
+        for( u32 i = 0; i < MUTEX_SPIN; i++ ) {
+            if( try_lock() )
+                return;
+            arch::cpu_relax();
+        }
+
+        wait::wait_event( &waiters, [this] { return try_lock(); } );
+    }
+
+    void unlock() {
+        // The exchange is a full barrier: a waiter queued before it sees
+        // the lock free on its re-check, or is seen here
+        auto prev = __atomic_exchange_n( &owner, nullptr, __ATOMIC_SEQ_CST );
+        if( prev != sched::get_current_task() )
+            panic( "mutex_t::unlock: not the owner" );
+
+        if( wait::has_waiters( &waiters ) )
+            wait::wake_one( &waiters );
+    }
+
+    inline bool is_locked() {
+        return __atomic_load_n( &owner, __ATOMIC_RELAXED ) != nullptr;
+    }
+
+    mutex_t(const mutex_t&) = delete;
+    mutex_t& operator=(const mutex_t&) = delete;
+};
+
+// Scoped mutex_t::lock()/unlock().
+export class mutex_guard {
+private:
+    mutex_t &mutex;
+
+public:
+    explicit mutex_guard( mutex_t &mutex ) : mutex( mutex ) {
+        mutex.lock();
+    }
+
+    ~mutex_guard() {
+        mutex.unlock();
+    }
+
+    mutex_guard(const mutex_guard&) = delete;
+    mutex_guard& operator=(const mutex_guard&) = delete;
+};
+
+/*
+ * Counting semaphore. up() may be called from interrupt context, so a
+ * handler can hand work to a task sleeping in down().
+ */
+export class semaphore_t {
+private:
+    i32                 count;
+    wait::wait_queue_t  waiters;
+
+public:
+    constexpr explicit semaphore_t( i32 count = 0 ) : count( count ) {
+    }
+
+    inline bool try_down() {
+        i32 cur = __atomic_load_n( &count, __ATOMIC_RELAXED );
+        while( cur > 0 ) {
+            if( __atomic_compare_exchange_n( &count, &cur, cur - 1, true,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+                return true;
+        }
+        return false;
+    }
+
+    void down() {
+        wait::wait_event( &waiters, [this] { return try_down(); } );
+    }
+
+    void up() {
+        __atomic_fetch_add( &count, 1, __ATOMIC_SEQ_CST );
+
+        if( wait::has_waiters( &waiters ) )
+            wait::wake_one( &waiters );
+    }
+
+    inline i32 value() {
+        return __atomic_load_n( &count, __ATOMIC_RELAXED );
+    }
+
+    semaphore_t(const semaphore_t&) = delete;
+    semaphore_t& operator=(const semaphore_t&) = delete;
+};
+
+/*
+ * Condition variable for use with a mutex_t. wait() may return without a
+ * signal, so callers re-check their predicate in a loop.
+ */
+export class condvar_t {
+private:
+    wait::wait_queue_t waiters;
+
+public:
+    constexpr condvar_t() = default;
+
+    // Atomically release `mutex` and sleep; `mutex` is held again on return
+    void wait( mutex_t &mutex ) {
+        wait::wait_entry_t entry = { nullptr, nullptr, sched::get_current_task(), false };
+        auto flags = arch::irq_save();
+
+        // Queued before the unlock, so a signal sent after it finds us
+        wait::prepare_to_wait( &waiters, &entry );
+        mutex.unlock();
+        sched::schedule();
+        wait::finish_wait( &waiters, &entry );
+
+        arch::irq_restore( flags );
+        mutex.lock();
+    }
+
+    inline void signal() {
+        wait::wake_one( &waiters );
+    }
+
+    inline void broadcast() {
+        wait::wake_all( &waiters );
+    }
+
+    condvar_t(const condvar_t&) = delete;
+    condvar_t& operator=(const condvar_t&) = delete;
+};
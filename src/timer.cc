@@ -0,0 +1,296 @@
+export module timer;
+
+import types;
+import arch.cpu;
+import arch.time;
+import arch.lapic;
+import lib.print;
+import lib.spinlock;
+
+// Per-CPU hierarchical timer wheel on the ktime_ns() clock.
+//
+// Time is counted in units of 2^TIMER_SHIFT ns. Level L has 64 slots of
+// 64^L units each; a timer goes into the lowest level whose range covers
+// it, so adding and cancelling are a list insert/remove. When the wheel
+// clock crosses a slot boundary of level L, that slot is cascaded: its
+// timers are re-added and drop to lower levels. Timers beyond the range of
+// the top level wait in its farthest slot and are re-added from there.
+//
+// Each CPU programs its own one-shot LAPIC timer for the earliest slot
+// that needs processing, so a CPU without timers takes no interrupts.
+constexpr auto TIMER_SHIFT  = 16;           // ~65us units
+constexpr auto WHEEL_BITS   = 6;
+constexpr auto WHEEL_SLOTS  = 1 << WHEEL_BITS;
+constexpr auto WHEEL_MASK   = WHEEL_SLOTS - 1;
+constexpr auto WHEEL_LEVELS = 4;
+constexpr auto WHEEL_RANGE  = 1UL << (WHEEL_BITS * WHEEL_LEVELS);
+
+constexpr auto NO_EVENT     = ~0UL;
+
+export namespace timer {
+    typedef void (timer_fn_t)( void *data );
+
+    struct timer_t {
+        timer_t    *next;
+        timer_t    *prev;
+        u64         expires;        // wheel units
+        timer_fn_t *fn;
+        void       *data;
+        u32         cpu;            // wheel the timer is queued on
+        u16         slot;           // level * WHEEL_SLOTS + slot while queued
+        bool        pending;
+    };
+}
+
+using timer::timer_t;
+
+struct alignas(64) timer_base_t {
+    spinlock_t  lock;
+    u64         clk;                        // next unit to process
+    u64         cascaded;                   // last clk the cascade ran for
+    u64         programmed = NO_EVENT;      // unit the LAPIC is armed for
+    u64         pending_map[WHEEL_LEVELS];  // non-empty slots per level
+    timer_t    *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static timer_base_t timer_bases[MAX_CPU];
+
+static inline u64
+rotr( u64 word, u32 n ) {
+    n &= 63;
+    return n ? (word >> n) | (word << (64 - n)) : word;
+}
+
+static void
+wheel_insert( timer_base_t *base, timer_t *t ) {
+    u64 expires = t->expires;
+
+    if( expires < base->clk )
+        expires = base->clk;
+    if( expires - base->clk >= WHEEL_RANGE )
+        expires = base->clk + WHEEL_RANGE - 1;
+
+    u64 delta = expires - base->clk;
+    u32 level = 0;
+    while( level < WHEEL_LEVELS - 1 && delta >= 1UL << (WHEEL_BITS * (level + 1)) )
+        level++;
+
+    u32 slot  = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    auto head = &base->slots[level][slot];
+
+    t->slot = level * WHEEL_SLOTS + slot;
+    t->prev = nullptr;
+    t->next = *head;
+    if( *head )
+        (*head)->prev = t;
+    *head = t;
+
+    base->pending_map[level] |= 1UL << slot;
+}
+
+static void
+wheel_remove( timer_base_t *base, timer_t *t ) {
+    u32 level = t->slot / WHEEL_SLOTS;
+    u32 slot  = t->slot % WHEEL_SLOTS;
+
+    if( t->prev ) {
+        t->prev->next = t->next;
+    } else {
+        base->slots[level][slot] = t->next;
+        if( !t->next )
+            base->pending_map[level] &= ~(1UL << slot);
+    }
+    if( t->next )
+        t->next->prev = t->prev;
+    t->next = t->prev = nullptr;
+}
+
+/*
+ * The earliest unit at which something has to be done: a level 0 slot
+ * expiring or a higher-level slot due to cascade.
+ */
+static u64
+next_event( timer_base_t *base ) {
+    u64 best = NO_EVENT;
+
+    for( u32 level = 0; level < WHEEL_LEVELS; level++ ) {
+        if( !base->pending_map[level] )
+            continue;
+
+        u32 shift = WHEEL_BITS * level;
+        u64 index = base->clk >> shift;
+        u64 when;
+
+        if( level == 0 ) {
+            // Slots from the current one on, wrapping into the next lap
+            when = base->clk + __builtin_ctzll( rotr( base->pending_map[0], index & WHEEL_MASK ) );
+        } else {
+            // Level L slots are cascaded when the clock enters them, so
+            // the current one (already cascaded) is due a full lap later
+            u64 k = __builtin_ctzll( rotr( base->pending_map[level], (index + 1) & WHEEL_MASK ) ) + 1;
+            when = (index + k) << shift;
+        }
+
+        if( when < best )
+            best = when;
+    }
+
+    return best;
+}
+
+// Re-add the timers of the level `level` slot the clock just entered
+static void
+cascade( timer_base_t *base, u32 level ) {
+    u32 slot = (base->clk >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    auto t   = base->slots[level][slot];
+
+    base->slots[level][slot] = nullptr;
+    base->pending_map[level] &= ~(1UL << slot);
+
+    while( t ) {
+        auto next = t->next;
+        wheel_insert( base, t );
+        t = next;
+    }
+}
+
+/*
+ * Move the wheel clock to `clk`. A clock that lands on a level L boundary,
+ * by a jump or by counting up, enters a new slot of that level, which is
+ * cascaded now: next_event() treats the current slot as done.
+ */
+static void
+set_clock( timer_base_t *base, u64 clk ) {
+    base->clk = clk;
+
+    if( clk == base->cascaded )
+        return;
+    base->cascaded = clk;
+
+    // A new level L slot starts a new slot of every level below
+    for( u32 level = 1; level < WHEEL_LEVELS; level++ ) {
+        if( clk & ((1UL << (WHEEL_BITS * level)) - 1) )
+            break;
+        cascade( base, level );
+    }
+}
+
+// Arm this CPU's LAPIC timer for the next event if that changed
+static void
+program_timer( timer_base_t *base ) {
+    u64 event = next_event( base );
+
+    if( event == base->programmed )
+        return;
+    base->programmed = event;
+
+    if( event == NO_EVENT ) {
+        arch::lapic_timer_stop();
+        return;
+    }
+
+    u64 now  = arch::ktime_ns();
+    u64 when = event << TIMER_SHIFT;
+    arch::lapic_timer_arm_ns( when > now ? when - now : 0 );
+}
+
+export namespace timer {
+    inline u64
+    ns_to_units( u64 ns ) {
+        // Round up so a timer never fires early
+        return (ns + (1UL << TIMER_SHIFT) - 1) >> TIMER_SHIFT;
+    }
+
+    void
+    init_timer( timer_t *t, timer_fn_t *fn, void *data ) {
+        t->next    = t->prev = nullptr;
+        t->fn      = fn;
+        t->data    = data;
+        t->pending = false;
+    }
+
+    /*
+     * Cancel a pending timer. Returns whether it was pending. The callback
+     * may already be running on the timer's CPU when this returns false.
+     */
+    bool
+    del_timer( timer_t *t ) {
+        if( !__atomic_load_n( &t->pending, __ATOMIC_ACQUIRE ) )
+            return false;
+
+        auto base  = &timer_bases[t->cpu];
+        auto flags = base->lock.lock_irqsave();
+
+        bool pending = t->pending;
+        if( pending ) {
+            wheel_remove( base, t );
+            t->pending = false;
+        }
+
+        base->lock.release_irqrestore( flags );
+        return pending;
+    }
+
+    // (Re)arm a timer to run `fn` on this CPU at ktime_ns() >= `deadline_ns`
+    void
+    add_timer( timer_t *t, u64 deadline_ns ) {
+        del_timer( t );
+
+        auto cpu   = arch::this_cpu();
+        auto base  = &timer_bases[cpu];
+        auto flags = base->lock.lock_irqsave();
+
+        t->expires = ns_to_units( deadline_ns );
+        t->cpu     = cpu;
+        t->pending = true;
+        wheel_insert( base, t );
+        program_timer( base );
+
+        base->lock.release_irqrestore( flags );
+    }
+
+    /*
+     * Run the expired timers of this CPU and re-arm the LAPIC for the next
+     * one. Called from the timer interrupt; callbacks run with interrupts
+     * off and the wheel unlocked, so they may add timers.
+     */
+    void
+    run_timers() {
+        auto base   = &timer_bases[arch::this_cpu()];
+        u64  target = arch::ktime_ns() >> TIMER_SHIFT;
+
+        base->lock.lock();
+
+        while( base->clk <= target ) {
+            u64 event = next_event( base );
+            if( event > target ) {
+                set_clock( base, target + 1 );
+                break;
+            }
+
+            set_clock( base, event );
+
+            // One timer at a time: the rest stay queued, and cancellable,
+            // while a callback runs. Timers a callback adds for the current
+            // unit land in this slot and run in this loop too.
+            u32 slot = base->clk & WHEEL_MASK;
+            while( auto t = base->slots[0][slot] ) {
+                wheel_remove( base, t );
+
+                auto fn   = t->fn;
+                auto data = t->data;
+                __atomic_store_n( &t->pending, false, __ATOMIC_RELEASE );
+
+                base->lock.release();
+                fn( data );
+                base->lock.lock();
+            }
+
+            set_clock( base, base->clk + 1 );
+        }
+
+        base->programmed = NO_EVENT - 1;    // force a reprogram
+        program_timer( base );
+        base->lock.release();
+    }
+}
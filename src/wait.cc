@@ -0,0 +1,152 @@
+export module wait;
+
+import types;
+import arch.cpu;
+import lib.spinlock;
+import sched;
+
+// Wait queues: a task that has to wait for an event links an entry into
+// the event's queue and blocks, off every run queue, until the side that
+// makes the event happen wakes it. Waking is safe from interrupt context.
+export namespace wait {
+    struct wait_entry_t {
+        wait_entry_t  *next;
+        wait_entry_t  *prev;
+        sched::task_t *task;
+        bool           queued;
+    };
+
+    struct wait_queue_t {
+        spinlock_t    lock;
+        wait_entry_t *head = nullptr;
+        wait_entry_t *tail = nullptr;
+    };
+
+    // Caller holds wq->lock
+    inline void
+    enqueue_entry( wait_queue_t *wq, wait_entry_t *entry ) {
+        entry->next = nullptr;
+        entry->prev = wq->tail;
+        if( wq->tail )
+            wq->tail->next = entry;
+        else
+            wq->head = entry;
+        wq->tail      = entry;
+        entry->queued = true;
+    }
+
+    // Caller holds wq->lock
+    inline void
+    dequeue_entry( wait_queue_t *wq, wait_entry_t *entry ) {
+        if( entry->prev )
+            entry->prev->next = entry->next;
+        else
+            wq->head = entry->next;
+        if( entry->next )
+            entry->next->prev = entry->prev;
+        else
+            wq->tail = entry->prev;
+        entry->next = entry->prev = nullptr;
+        __atomic_store_n( &entry->queued, false, __ATOMIC_RELEASE );
+    }
+
+    /*
+     * Queue the current task on `wq` (unless still queued from an earlier
+     * round) and mark it blocked. The caller then re-checks its condition
+     * and calls sched::schedule() only if it is still false; a wake in
+     * between leaves the task running instead of being lost. Interrupts
+     * must stay off from here until schedule(), or a timer preemption
+     * would switch the task out as blocked.
+     */
+    void
+    prepare_to_wait( wait_queue_t *wq, wait_entry_t *entry ) {
+        wq->lock.lock();
+        if( !entry->queued )
+            enqueue_entry( wq, entry );
+        sched::prepare_to_block();
+        wq->lock.release();
+
+        // Order the queue insertion before the caller's condition check;
+        // wakers publish their event before looking at the queue
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    }
+
+    // Undo prepare_to_wait() once the condition holds
+    void
+    finish_wait( wait_queue_t *wq, wait_entry_t *entry ) {
+        sched::finish_block();
+
+        if( __atomic_load_n( &entry->queued, __ATOMIC_ACQUIRE ) ) {
+            auto flags = wq->lock.lock_irqsave();
+            if( entry->queued )
+                dequeue_entry( wq, entry );
+            wq->lock.release_irqrestore( flags );
+        }
+    }
+
+    /*
+     * Block until `cond()` is true. `cond` runs with interrupts off and may
+     * be called several times, so it must be cheap and free of side effects
+     * unless it succeeds. Before the scheduler runs this spins.
+     */
+    template<typename Cond>
+    void
+    wait_event( wait_queue_t *wq, Cond cond ) {
+        if( cond() )
+            return;
+
+        if( !sched::scheduler_ready ) {
+            while( !cond() )
+                arch::cpu_relax();
+            return;
+        }
+
+        wait_entry_t entry = { nullptr, nullptr, sched::get_current_task(), false };
+        auto flags = arch::irq_save();
+
+        for( ;; ) {
+            prepare_to_wait( wq, &entry );
+            if( cond() )
+                break;
+            sched::schedule();
+        }
+
+        finish_wait( wq, &entry );
+        arch::irq_restore( flags );
+    }
+
+    // Wake the longest waiting task. Returns false if there was none.
+    bool
+    wake_one( wait_queue_t *wq ) {
+        auto flags = wq->lock.lock_irqsave();
+
+        // The entry may go away as soon as it is dequeued
+        auto entry = wq->head;
+        if( entry ) {
+            auto task = entry->task;
+            dequeue_entry( wq, entry );
+            sched::wake_up( task );
+        }
+
+        wq->lock.release_irqrestore( flags );
+        return entry != nullptr;
+    }
+
+    void
+    wake_all( wait_queue_t *wq ) {
+        auto flags = wq->lock.lock_irqsave();
+
+        while( auto entry = wq->head ) {
+            auto task = entry->task;
+            dequeue_entry( wq, entry );
+            sched::wake_up( task );
+        }
+
+        wq->lock.release_irqrestore( flags );
+    }
+
+    inline bool
+    has_waiters( wait_queue_t *wq ) {
+        return __atomic_load_n( &wq->head, __ATOMIC_RELAXED ) != nullptr;
+    }
+}
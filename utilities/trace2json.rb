@@ -0,0 +1,204 @@
+#!/usr/bin/env ruby
+
+# Turns the event trace a TRACE=1 kernel dumps to COM1 (see src/lib/trace.cc)
+# into Chrome trace event JSON for chrome://tracing or ui.perfetto.dev.
+#
+#   make TRACE=1 run 2>&1 | tee serial.log   # boot with "trace"
+#   utilities/trace2json.rb serial.log > trace.json
+#
+# Every CPU becomes a process with a "tasks" track (one slice per task run,
+# allocator and mapping events as instants) and an "irq" track.
+
+require 'json'
+require 'optparse'
+
+class TraceDecoder
+  # Keep in sync with trace::event_t in src/lib/trace.cc
+  EVENTS = {
+    1 => :switch,
+    2 => :irq_entry,
+    3 => :irq_exit,
+    4 => :kmalloc,
+    5 => :kfree,
+    6 => :page_alloc,
+    7 => :page_free,
+    8 => :map_page
+  }.freeze
+
+  TASK_STATES = %w[ready running blocked terminated].freeze
+
+  TASKS_TID = 0
+  IRQ_TID   = 1
+
+  Record = Struct.new(:cpu, :tsc, :event, :args)
+
+  attr_reader :records, :tsc_hz
+
+  def initialize
+    @records = []
+    @tsc_hz  = nil
+  end
+
+  # Collect the records of the last complete dump in the log
+  def parse(io)
+    current = nil
+
+    io.each_line do |line|
+      line = line.strip
+
+      if line =~ /@TRACE begin tsc_hz=(\h+)/
+        current = []
+        @tsc_hz = $1.hex
+      elsif line =~ /@TRACE end/
+        @records = current if current
+        current = nil
+      elsif current && line =~ /@T ((?:\h+ ?){6})$/
+        cpu, tsc, event, *args = $1.split.map(&:hex)
+        current << Record.new(cpu, tsc, EVENTS.fetch(event, event), args)
+      end
+    end
+
+    # A dump cut short still beats nothing
+    @records = current if @records.empty? && current
+    self
+  end
+
+  def to_chrome
+    raise 'no trace dump found' if @records.empty?
+    raise 'trace dump without tsc_hz' unless @tsc_hz&.positive?
+
+    @records.sort_by!(&:tsc)
+    base   = @records.first.tsc
+    events = []
+
+    us = ->(tsc) { (tsc - base) * 1_000_000.0 / @tsc_hz }
+
+    running   = {}    # cpu -> [pid, start tsc]
+    irq_depth = Hash.new(0)
+    last_tsc  = {}
+
+    @records.each do |r|
+      ts = us.(r.tsc)
+      last_tsc[r.cpu] = r.tsc
+
+      case r.event
+      when :switch
+        _prev, nxt, state = r.args
+        start = running[r.cpu]
+        if start
+          events << slice(r.cpu, "pid #{start[0]}", us.(start[1]), ts - us.(start[1]),
+                          'prev_state' => TASK_STATES.fetch(state, state))
+        end
+        running[r.cpu] = [nxt, r.tsc]
+
+        # A handler that switched tasks leaves its exit to whichever task
+        # returns through it later, maybe on another CPU or never, so its
+        # slice ends here and later unmatched exits are dropped
+        irq_depth[r.cpu].times { events << { ph: 'E', ts: ts, pid: r.cpu, tid: IRQ_TID } }
+        irq_depth[r.cpu] = 0
+      when :irq_entry
+        irq_depth[r.cpu] += 1
+        events << { name: irq_name(r.args[0]), ph: 'B', ts: ts, pid: r.cpu, tid: IRQ_TID,
+                    args: { rip: hex(r.args[1]) } }
+      when :irq_exit
+        # An exit may belong to an interrupt entered before the dump starts
+        # or one already closed by a switch
+        next if irq_depth[r.cpu].zero?
+
+        irq_depth[r.cpu] -= 1
+        events << { ph: 'E', ts: ts, pid: r.cpu, tid: IRQ_TID }
+      when :kmalloc
+        events << instant(r.cpu, 'kmalloc', ts, size: r.args[0], ptr: hex(r.args[1]))
+      when :kfree
+        events << instant(r.cpu, 'kfree', ts, ptr: hex(r.args[0]))
+      when :page_alloc
+        events << instant(r.cpu, 'page_alloc', ts, phys: hex(r.args[0]), pages: r.args[1])
+      when :page_free
+        events << instant(r.cpu, 'page_free', ts, phys: hex(r.args[0]), pages: r.args[1])
+      when :map_page
+        events << instant(r.cpu, 'map_page', ts, virt: hex(r.args[0]), phys: hex(r.args[1]),
+                                                 flags: hex(r.args[2]))
+      else
+        events << instant(r.cpu, "event #{r.event}", ts, args: r.args.map { |a| hex(a) })
+      end
+    end
+
+    # Close whatever was still running when the trace stopped
+    running.each do |cpu, (pid, start)|
+      events << slice(cpu, "pid #{pid}", us.(start), us.(last_tsc[cpu]) - us.(start))
+    end
+    irq_depth.each do |cpu, depth|
+      depth.times { events << { ph: 'E', ts: us.(last_tsc[cpu]), pid: cpu, tid: IRQ_TID } }
+    end
+
+    last_tsc.each_key do |cpu|
+      events << meta(cpu, nil, 'process_name', "CPU #{cpu}")
+      events << meta(cpu, TASKS_TID, 'thread_name', 'tasks')
+      events << meta(cpu, IRQ_TID, 'thread_name', 'irq')
+    end
+
+    { traceEvents: events, displayTimeUnit: 'ns' }
+  end
+
+  def self.run(args)
+    output = nil
+
+    OptionParser.new do |opts|
+      opts.banner = "Usage: #{$0} [options] [serial.log]"
+      opts.on('-o', '--output FILE', 'Write the JSON to FILE instead of stdout') do |file|
+        output = file
+      end
+      opts.on('-h', '--help', 'Show this help') do
+        puts opts
+        exit
+      end
+    end.parse!(args)
+
+    decoder = new
+    if args.empty?
+      decoder.parse($stdin)
+    else
+      File.open(args.first, 'rb') { |f| decoder.parse(f) }
+    end
+
+    json = JSON.generate(decoder.to_chrome)
+    if output
+      File.write(output, json)
+      warn "#{decoder.records.length} events written to #{output}"
+    else
+      puts json
+    end
+  rescue RuntimeError, SystemCallError => e
+    warn "Error: #{e.message}"
+    exit 1
+  end
+
+  private
+
+  def slice(cpu, name, ts, dur, args = {})
+    { name: name, ph: 'X', ts: ts, dur: dur, pid: cpu, tid: TASKS_TID, args: args }
+  end
+
+  def instant(cpu, name, ts, args)
+    { name: name, ph: 'i', s: 't', ts: ts, pid: cpu, tid: TASKS_TID, args: args }
+  end
+
+  def meta(cpu, tid, kind, name)
+    event = { name: kind, ph: 'M', pid: cpu, args: { name: name } }
+    event[:tid] = tid if tid
+    event
+  end
+
+  def irq_name(vector)
+    vector < 32 ? "exception #{vector}" : format('irq 0x%02x', vector)
+  end
+
+  def hex(value)
+    format('0x%x', value)
+  end
+end
+
+# Command line interface
+if __FILE__ == $0
+  TraceDecoder.run(ARGV)
+end